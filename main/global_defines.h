@@ -16,3 +16,5 @@
 
 
 #define EVENT_START_TEST (100)
+#define EVENT_START_BENCH (200)
+#define EVENT_START_DSL_TEST (300)
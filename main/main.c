@@ -9,6 +9,8 @@
 
 #include "global_defines.h"
 #include "state_test.h"
+#include "state_dsl_test.h"
+#include "state_bench.h"
 
 /**********************************************************
 *                                        STATIC VARIABLES *
@@ -26,10 +28,16 @@ void app_main(void) {
   }
 
   state_core_spawner();
+#if CONFIG_STATE_CORE_RUN_BENCHMARKS
+  state_bench_run();
+#endif
   test_state_spawner();
+  test_timer_wheel();
+  dsl_test_spawner();
 
   while(true){
     state_post_event(TEST_EVENT_A);      // this will cause us to go from state_a -> state_b
+    state_post_event(DSL_TEST_EVENT_TOGGLE);
     vTaskDelay(5000/portTICK_PERIOD_MS); // delay for 5 seconds
 
     // Inside state_b, we will loop 10 times and force entry into state_a on the 10th time, this will be done in 
@@ -0,0 +1,413 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_bench.h"
+#include "state_ring.h"
+
+/*********************************************************
+*                                                DEFINES *
+*********************************************************/
+#define BENCH_ITERATIONS (1000)
+#define BENCH_EVENTS     (3200) // divisible by every batch size
+#define BENCH_MAX_BATCH  (32)
+#define BENCH_LANES      (2)    // one poster and one sink machine per core
+#define BENCH_BACKLOG    (12)   // BENCH_EVENT_BUSY queued ahead of a ping, fits in the machine's queue
+#define BENCH_BUSY_US    (200)  // time to handle one BENCH_EVENT_BUSY
+#define BENCH_SATURATED_ITERATIONS (100)
+
+/*********************************************************
+*                                               TYPEDEFS *
+*********************************************************/
+// One poster -> event -> sink machine pipeline of the scaling benchmark
+typedef struct {
+    state_event_t   event;
+    TaskHandle_t    poster;
+    volatile int    received;
+} bench_lane_t;
+
+/*********************************************************
+*                                       STATIC VARIABLES *
+*********************************************************/
+static const char        TAG[] = "STATE_BENCH";
+static TaskHandle_t      bench_task;
+static volatile int64_t  post_time_us;
+static int64_t           latency_us;
+static volatile int      received;
+static volatile int      busy_received;
+static bench_lane_t      lanes[BENCH_LANES];
+
+/**********************************************************
+*                                         STATE FUNCTIONS *
+**********************************************************/
+
+// Only state, everything happens in next_state_func
+static state_t state_idle() {
+  return NULL_STATE;
+}
+
+// Records how long the event took to get here, and wakes up the bench task
+static void next_state_func(state_t* curr_state, state_event_t event) {
+    if (event == BENCH_EVENT_PING || event == BENCH_EVENT_PING_RING || event == BENCH_EVENT_PING_NOTIFY ||
+        event == BENCH_EVENT_PING_BUSY) {
+        latency_us = esp_timer_get_time() - post_time_us;
+        xTaskNotifyGive(bench_task);
+    }
+    if (event == BENCH_EVENT_BUSY) {
+        int64_t until = esp_timer_get_time() + BENCH_BUSY_US;
+        while (esp_timer_get_time() < until) {
+        }
+        busy_received++;
+    }
+    if (event == BENCH_EVENT_COUNT) {
+        received++;
+        xTaskNotifyGive(bench_task);
+    }
+    if (event >= BENCH_EVENT_LOAD_0 && event < BENCH_EVENT_LOAD_0 + BENCH_LANES) {
+        bench_lane_t* lane = &lanes[event - BENCH_EVENT_LOAD_0];
+        lane->received++;
+        xTaskNotifyGive(lane->poster);
+    }
+}
+
+static state_array_s func_translation_table[bench_state_len] = {
+   { state_idle   ,  portMAX_DELAY                             , NULL ,  STATE_NO_PARENT ,  NULL },
+};
+
+static const state_event_t subscribed_events[] = {
+   BENCH_EVENT_PING,
+   BENCH_EVENT_COUNT,
+};
+
+static const state_event_t ring_events[] = {
+   BENCH_EVENT_PING_RING,
+};
+
+static const state_event_t notify_events[] = {
+   BENCH_EVENT_PING_NOTIFY,
+};
+
+static const state_event_t busy_events[] = {
+   BENCH_EVENT_BUSY,
+   BENCH_EVENT_PING_BUSY,
+};
+
+static const state_event_t sink_events[BENCH_LANES][1] = {
+   { BENCH_EVENT_LOAD_0 },
+   { BENCH_EVENT_LOAD_1 },
+};
+
+static char* event_print_func(state_event_t event) {
+  static char event_ping_st[] = "BENCH_EVENT_PING";
+  static char event_count_st[] = "BENCH_EVENT_COUNT";
+  if(event == BENCH_EVENT_PING || event == BENCH_EVENT_PING_RING || event == BENCH_EVENT_PING_NOTIFY ||
+     event == BENCH_EVENT_PING_BUSY){
+    return event_ping_st;
+  }
+  static char event_load_st[] = "BENCH_EVENT_LOAD";
+  static char event_busy_st[] = "BENCH_EVENT_BUSY";
+  if(event == BENCH_EVENT_COUNT){
+    return event_count_st;
+  }
+  if(event == BENCH_EVENT_BUSY){
+    return event_busy_st;
+  }
+  if(event >= BENCH_EVENT_LOAD_0 && event < BENCH_EVENT_LOAD_0 + BENCH_LANES){
+    return event_load_st;
+  }
+  return NULL;
+}
+
+static state_init_s* get_bench_state_handle() {
+    static state_init_s bench_state = {
+        .next_state              = next_state_func,
+        .translation_table       = func_translation_table,
+        .event_print             = event_print_func,
+        .starting_state          = bench_state_idle_enum,
+        .state_name_string       = "bench_state",
+        .subscribed_events       = subscribed_events,
+        .total_subscribed_events = sizeof(subscribed_events) / sizeof(subscribed_events[0]),
+        .total_states            = bench_state_len,
+    };
+    return &(bench_state);
+}
+
+// Same as the bench machine, but with a ring inbox
+static state_init_s* get_ring_state_handle() {
+    static state_init_s ring_state = {
+        .next_state              = next_state_func,
+        .translation_table       = func_translation_table,
+        .event_print             = event_print_func,
+        .starting_state          = bench_state_idle_enum,
+        .state_name_string       = "bench_ring",
+        .subscribed_events       = ring_events,
+        .total_subscribed_events = sizeof(ring_events) / sizeof(ring_events[0]),
+        .total_states            = bench_state_len,
+        .inbox                   = STATE_INBOX_RING,
+    };
+    return &(ring_state);
+}
+
+// Same as the bench machine, but with a notification inbox
+static state_init_s* get_notify_state_handle() {
+    static state_init_s notify_state = {
+        .next_state              = next_state_func,
+        .translation_table       = func_translation_table,
+        .event_print             = event_print_func,
+        .starting_state          = bench_state_idle_enum,
+        .state_name_string       = "bench_notify",
+        .subscribed_events       = notify_events,
+        .total_subscribed_events = sizeof(notify_events) / sizeof(notify_events[0]),
+        .total_states            = bench_state_len,
+        .inbox                   = STATE_INBOX_NOTIFY,
+    };
+    return &(notify_state);
+}
+
+// Same as the bench machine, but slow to handle BENCH_EVENT_BUSY
+static state_init_s* get_busy_state_handle() {
+    static state_init_s busy_state = {
+        .next_state              = next_state_func,
+        .translation_table       = func_translation_table,
+        .event_print             = event_print_func,
+        .starting_state          = bench_state_idle_enum,
+        .state_name_string       = "bench_busy",
+        .subscribed_events       = busy_events,
+        .total_subscribed_events = sizeof(busy_events) / sizeof(busy_events[0]),
+        .total_states            = bench_state_len,
+    };
+    return &(busy_state);
+}
+
+// Sink machines of the scaling benchmark, one pinned to each core
+static state_init_s* get_sink_state_handle(int lane) {
+    static state_init_s sink_states[BENCH_LANES];
+    static char         names[BENCH_LANES][configMAX_TASK_NAME_LEN];
+
+    snprintf(names[lane], sizeof(names[lane]), "bench_sink_%d", lane);
+    sink_states[lane] = (state_init_s) {
+        .next_state              = next_state_func,
+        .translation_table       = func_translation_table,
+        .event_print             = event_print_func,
+        .starting_state          = bench_state_idle_enum,
+        .state_name_string       = names[lane],
+        .subscribed_events       = sink_events[lane],
+        .total_subscribed_events = 1,
+        .total_states            = bench_state_len,
+        .placement               = { .core = STATE_PLACE_CORE_0 + (lane % portNUM_PROCESSORS) },
+    };
+    return &(sink_states[lane]);
+}
+
+/**********************************************************
+*                                              BENCHMARKS *
+**********************************************************/
+
+// Post -> next_state latency, one event in flight at a time
+static void bench_post_latency(const char* name, state_event_t event) {
+    int64_t total = 0;
+    int64_t worst = 0;
+
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        post_time_us = esp_timer_get_time();
+        state_post_event(event);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        total += latency_us;
+        if (latency_us > worst) {
+            worst = latency_us;
+        }
+    }
+    printf("%-26s avg %lld us, max %lld us (%d events)\n", name, (long long)(total / BENCH_ITERATIONS), (long long)worst, BENCH_ITERATIONS);
+}
+
+// Post -> next_state latency of a ping posted with prio right behind a
+// backlog of slow normal events, so the machine is busy when it arrives
+static void bench_saturated_latency(const char* name, state_prio_e prio) {
+    state_event_t backlog[BENCH_BACKLOG];
+    int64_t       total = 0;
+    int64_t       worst = 0;
+
+    for (int i = 0; i < BENCH_BACKLOG; i++) {
+        backlog[i] = BENCH_EVENT_BUSY;
+    }
+
+    for (int i = 0; i < BENCH_SATURATED_ITERATIONS; i++) {
+        busy_received = 0;
+        state_post_events(backlog, BENCH_BACKLOG);
+
+        post_time_us = esp_timer_get_time();
+        state_post_event(STATE_EVENT_WITH_PRIO(BENCH_EVENT_PING_BUSY, prio));
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        total += latency_us;
+        if (latency_us > worst) {
+            worst = latency_us;
+        }
+
+        // Start every round with an empty inbox
+        while (busy_received < BENCH_BACKLOG) {
+            vTaskDelay(1);
+        }
+    }
+    printf("%-26s avg %lld us, max %lld us (%d events)\n", name, (long long)(total / BENCH_SATURATED_ITERATIONS), (long long)worst, BENCH_SATURATED_ITERATIONS);
+}
+
+// CPU cycles for one send + receive through each inbox type, without
+// contention or blocking, so only the cost of the container itself
+static void bench_inbox_ops() {
+    QueueHandle_t queue = xQueueCreate(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t));
+    state_ring_t  ring;
+    state_event_t event = BENCH_EVENT_COUNT;
+    bool          ok    = state_ring_init(&ring, EVENT_QUEUE_MAX_DEPTH);
+    ASSERT(queue);
+    ASSERT(ok);
+
+    uint32_t start = esp_cpu_get_ccount();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        xQueueSendToBack(queue, &event, RTOS_DONT_WAIT);
+        xQueueReceive(queue, &event, RTOS_DONT_WAIT);
+    }
+    uint32_t queue_cycles = esp_cpu_get_ccount() - start;
+
+    start = esp_cpu_get_ccount();
+    for (int i = 0; i < BENCH_ITERATIONS; i++) {
+        state_ring_push(&ring, event);
+        state_ring_pop(&ring, &event);
+    }
+    uint32_t ring_cycles = esp_cpu_get_ccount() - start;
+
+    printf("queue inbox              %u cycles/event\n", (unsigned)(queue_cycles / BENCH_ITERATIONS));
+    printf("ring inbox               %u cycles/event\n", (unsigned)(ring_cycles / BENCH_ITERATIONS));
+
+    vQueueDelete(queue);
+    state_ring_free(&ring);
+}
+
+// Events per second through post -> multiplexer -> next_state, posting in
+// bursts of batch events. Keeps at most INCOMING_QUEUE_MAX_DEPTH events in
+// flight so the multiplexer ring can never overflow
+static void bench_post_throughput(size_t batch) {
+    state_event_t events[BENCH_MAX_BATCH];
+    for (size_t i = 0; i < batch; i++) {
+        events[i] = BENCH_EVENT_COUNT;
+    }
+
+    received = 0;
+    int64_t start = esp_timer_get_time();
+    for (int posted = 0; posted < BENCH_EVENTS; posted += batch) {
+        while (posted - received + (int)batch > INCOMING_QUEUE_MAX_DEPTH) {
+            ulTaskNotifyTake(pdTRUE, 1);
+        }
+
+        if (batch == 1) {
+            state_post_event(events[0]);
+        } else {
+            state_post_events(events, batch);
+        }
+    }
+    while (received < BENCH_EVENTS) {
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    printf("batch %-18d %lld events/sec\n", (int)batch, (long long)BENCH_EVENTS * 1000000 / (elapsed ? elapsed : 1));
+}
+
+// Posts BENCH_EVENTS of one lane's event as fast as the lane drains them
+static void bench_poster(void* arg) {
+    bench_lane_t* lane   = (bench_lane_t*)arg;
+    int           window = INCOMING_QUEUE_MAX_DEPTH / BENCH_LANES;
+
+    for (int posted = 0; posted < BENCH_EVENTS; posted++) {
+        while (posted - lane->received >= window) {
+            ulTaskNotifyTake(pdTRUE, 1);
+        }
+        state_post_event(lane->event);
+    }
+    while (lane->received < BENCH_EVENTS) {
+        ulTaskNotifyTake(pdTRUE, 1);
+    }
+
+    xTaskNotifyGive(bench_task);
+    vTaskDelete(NULL);
+}
+
+// Total events per second with one saturating poster per core, each posting
+// its own event to its own sink machine. Build with STATE_MUX_SHARDS 1 and 2
+// to compare multiplexer scaling
+static void bench_mux_scaling() {
+    int64_t start = esp_timer_get_time();
+
+    for (int i = 0; i < BENCH_LANES; i++) {
+        lanes[i].received = 0;
+        BaseType_t rc = xTaskCreatePinnedToCore(bench_poster,
+                                                "bench_poster",
+                                                2048,
+                                                (void*)&lanes[i],
+                                                STATE_MACHINE_PRIORITY,
+                                                &lanes[i].poster,
+                                                i % portNUM_PROCESSORS);
+        if (rc != pdPASS) {
+            ASSERT(0);
+        }
+    }
+
+    for (int i = 0; i < BENCH_LANES; i++) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    int64_t elapsed = esp_timer_get_time() - start;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%d mux shard(s)", STATE_MUX_SHARDS);
+    printf("%-24s %lld events/sec\n", name, (long long)BENCH_EVENTS * BENCH_LANES * 1000000 / (elapsed ? elapsed : 1));
+}
+
+void state_bench_run() {
+    ESP_LOGI(TAG, "Starting benchmarks");
+    bench_task = xTaskGetCurrentTaskHandle();
+    start_new_state_machine(get_bench_state_handle());
+    start_new_state_machine(get_ring_state_handle());
+    start_new_state_machine(get_notify_state_handle());
+    start_new_state_machine(get_busy_state_handle());
+    for (int i = 0; i < BENCH_LANES; i++) {
+        lanes[i].event = BENCH_EVENT_LOAD_0 + i;
+        start_new_state_machine(get_sink_state_handle(i));
+    }
+
+    // Let the machine reach its first state
+    vTaskDelay(10);
+
+    state_core_set_direct_dispatch(false);
+    bench_post_latency("multiplexer dispatch", BENCH_EVENT_PING);
+    bench_post_latency("multiplexer, ring inbox", BENCH_EVENT_PING_RING);
+    bench_post_latency("multiplexer, notify inbox", BENCH_EVENT_PING_NOTIFY);
+
+    state_core_set_direct_dispatch(true);
+    bench_post_latency("direct dispatch", BENCH_EVENT_PING);
+    bench_post_latency("direct, ring inbox", BENCH_EVENT_PING_RING);
+    bench_post_latency("direct, notify inbox", BENCH_EVENT_PING_NOTIFY);
+
+    state_core_set_direct_dispatch(false);
+
+    bench_saturated_latency("saturated, normal event", STATE_PRIO_NORMAL);
+    bench_saturated_latency("saturated, urgent event", STATE_PRIO_URGENT);
+
+    bench_inbox_ops();
+
+    bench_post_throughput(1);
+    bench_post_throughput(8);
+    bench_post_throughput(BENCH_MAX_BATCH);
+
+    bench_mux_scaling();
+}
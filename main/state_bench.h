@@ -0,0 +1,33 @@
+#pragma once
+#include "state_core.h"
+
+/***********************************************************
+ *                                                 GLOBALS *
+ **********************************************************/
+// Runs the state_core benchmarks and prints the results,
+// must be called after state_core_spawner()
+void state_bench_run();
+
+
+/***********************************************************
+ *                                                   ENUMS *
+ **********************************************************/
+typedef enum {
+  bench_state_idle_enum = 0,
+
+  bench_state_len //LEAVE AS LAST!
+} bench_state_e;
+
+
+typedef enum {
+  BENCH_EVENT_PING = EVENT_START_BENCH,
+  BENCH_EVENT_PING_RING,
+  BENCH_EVENT_COUNT,
+  BENCH_EVENT_LOAD_0, // one per core, consecutive so they land on different shards
+  BENCH_EVENT_LOAD_1,
+  BENCH_EVENT_PING_NOTIFY,
+  BENCH_EVENT_BUSY,      // slow to handle, backlog of the saturated latency benchmark
+  BENCH_EVENT_PING_BUSY,
+
+  bench_event_len //LEAVE AS LAST!
+} bench_event_e;
@@ -1,161 +1,2141 @@
+// Compiled in log level, see STATE_LOG_LEVEL
+#define LOG_LOCAL_LEVEL STATE_LOG_LEVEL
+
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/event_groups.h"
 
 #include "esp_system.h"
 #include "esp_log.h"
+#include "esp_cpu.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_ring.h"
+#include "state_log.h"
+#include "state_trace.h"
+
+/**********************************************************
+*                                        GLOBAL VARIABLES *
+**********************************************************/
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Sent through a queue inbox to wake its task up for an event in a higher
+// lane, never handed to the machine
+#define STATE_EVENT_WAKE (0xFFFFFFFE)
+
+/**********************************************************
+*                                                TYPEDEFS *
+**********************************************************/
+// One bit per registered state machine, indexed by registration order
+typedef uint64_t consumer_mask_t;
+
+// One entry in the routing index: every machine subscribed to an event
+typedef struct {
+    state_event_t   event;
+    consumer_mask_t subscribers;
+} route_t;
+
+// State hierarchy of a machine, flattened when it is registered
+typedef struct {
+    state_t*           parents;  // per state, NULL_STATE for a top level state
+    uint8_t*           depths;   // per state, 0 for a top level state
+    uint16_t*          handlers; // per state, where its handler chain starts
+    event_handler_ptr* chain;    // the state's handler and its parents', closest first, NULL terminated
+} hierarchy_t;
+
+// Transition table of a machine, compiled when it is registered
+typedef struct {
+    state_event_t  first_event; // lowest event ID in the table
+    uint32_t       span;        // number of event IDs covered by columns
+    uint16_t*      columns;     // per event ID - first_event, column + 1, 0 if not in the table
+    int            total_columns;
+    uint16_t*      cells;       // per state and column, first row + 1, 0 if none
+    uint16_t*      next_rows;   // per row, next row + 1 for the same state and event, 0 if none
+} transitions_t;
+
+// One of a machine's coalesced_events, and how many copies are in its inbox
+typedef struct {
+    state_event_t event;
+    uint32_t      waiting; // atomic
+} coalesce_t;
+
+// Occupancy counters of an event queue, see state_queue_stats_s. Atomic,
+// except reset_us, which only a reset writes
+typedef struct {
+    uint32_t high_water;
+    uint32_t enqueued;
+    uint32_t dequeued;
+    uint32_t full;
+    uint32_t full_us;
+    uint32_t full_since; // when the first event didn't fit (| 1), 0 while there is room
+    int64_t  reset_us;   // when the counters were started or reset
+} queue_stats_t;
+
+// Run-time context of a registered state machine, used by
+// both the per-machine task and the shared executor
+typedef struct state_machine_s {
+    state_init_s* info;
+    state_t       state;       // current state
+    state_array_s state_info;  // translation table entry of the current state
+    bool          waiting;     // state function ran, waiting for events / loop_timer
+    bool          started;     // parents of the starting state were entered
+    hierarchy_t*  hierarchy;   // NULL for a flat machine
+    transitions_t* transitions; // NULL without a transition table
+    TickType_t    wake_tick;   // executor only, when waiting for loop_timer to expire
+
+    TaskHandle_t  task;        // own task, NULL if hosted on the executor
+    BaseType_t    core;        // core the task is pinned to, tskNO_AFFINITY if not pinned
+    volatile BaseType_t target_core; // STATE_PLACE_AUTO only, core to move to at the next wait
+    uint32_t      load_cycles; // CPU cycles spent in state functions / next_state, wraps
+    uint32_t      load_mark;   // load_cycles at the last rebalance
+    volatile bool stopping;    // stop_state_machine() was called, whoever runs the machine retires it
+    volatile bool* stop_done;  // set once the machine is gone, NULL if nobody waits for it
+
+    // Per lane and producing shard. STATE_INBOX_RING uses every lane,
+    // STATE_INBOX_QUEUE only the ones above its queue
+    state_ring_t  rings[STATE_LANES][STATE_MUX_SHARDS];
+    state_ring_t  backlog[STATE_LANES][STATE_MUX_SHARDS]; // events that didn't fit in the inbox, allocated when first needed
+    int           next_ring;   // ring to read first, for fairness between the shards
+    uint32_t      lag_deferred; // events that went to the backlog, atomic
+    uint32_t      lag_dropped;  // events lost with the backlog full too, atomic
+    uint32_t      inbox_depth;  // of its queue and each ring
+    queue_stats_t queue_stats;  // of the whole inbox
+    uint8_t       lane_run;    // events taken from higher lanes in a row
+
+    uint32_t      notify_bits;    // STATE_INBOX_NOTIFY only, events routed before the task existed, atomic
+    uint32_t      notify_pending; // STATE_INBOX_NOTIFY only, events received but not handled yet
+    uint32_t      notify_lanes[STATE_LANES]; // STATE_INBOX_NOTIFY only, events posted in each higher lane, atomic
+
+    coalesce_t*   coalesce;       // coalesced_events, NULL if none
+    int           total_coalesce;
+    uint32_t      coalesced;      // copies absorbed, atomic
+
+    state_stats_s* stats;         // STATE_LATENCY only, buckets and max_us are atomic, count is left at 0
+    uint32_t      inbox_stamp;    // STATE_LATENCY only, when the event just taken was put in the inbox
+
+    struct profile_s* profile;    // STATE_PROFILE only, per state, only written by whoever runs the machine
+    bool          state_ran;      // STATE_PROFILE only, the state function ran since the state was entered
+} machine_t;
+
+// Profile of one state of a machine, and when it was last entered
+typedef struct profile_s {
+    state_profile_s counters;
+    int64_t         entered_us;
+} profile_t;
+
+// What a queue inbox holds
+typedef struct {
+    state_event_t event;
+#if STATE_LATENCY
+    uint32_t      stamp; // when it was queued
+#endif
+} queue_item_t;
+
+// Routing index and machine sets, as the dispatch path sees them. Never
+// changed once published: registering or removing a machine builds a new
+// one, and the old one is freed once no reader can still be holding it
+typedef struct {
+    consumer_mask_t live;                           // registered machines
+    consumer_mask_t dynamic;                        // machines with a filter_event
+    consumer_mask_t executor;                       // machines hosted on the executor
+    route_t*        routes[STATE_MUX_SHARDS];       // per shard, sorted by event
+    int             total_routes[STATE_MUX_SHARDS];
+} registry_t;
+
+// One multiplexer shard, routes the events whose ID hashes to it
+typedef struct {
+    state_mpsc_ring_t incoming[STATE_LANES];    // posted events per lane, any task or ISR -> multiplexer
+    state_mpsc_ring_t spill[STATE_LANES];       // STATE_OVERFLOW_SPILL only, no slots until it is picked
+    uint8_t           lane_run;                 // events taken from higher lanes in a row
+    TaskHandle_t      task;                     // the shard's multiplexer
+    volatile uint32_t sleeping;                 // multiplexer is (about to be) blocked, wants a notification
+    SemaphoreHandle_t lock;                     // held while delivering, the shard is the only producer of its inbox rings
+    queue_stats_t     queue_stats;              // of its incoming and spill rings
+} mux_shard_t;
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char        TAG[] = "STATE_CORE";
+static mux_shard_t       shards[STATE_MUX_SHARDS];
+static SemaphoreHandle_t consumer_sem;
+
+// Slots of the registered machines, by their bit in the subscriber masks.
+// Protected by consumer_sem. Routing only finds a slot through the
+// registry, so it is set up before it is published, and cleared once a
+// registry without it has been published
+static machine_t         consumers[STATE_MAX_MACHINES];
+
+// Current registry, published under consumer_sem and read without a lock
+// between registry_enter() and registry_exit()
+static registry_t*       registry;
+static uint32_t          registry_epoch;      // bumped by every publish, atomic
+static uint32_t          registry_readers[2]; // readers inside, by the parity of the epoch they entered in, atomic
+
+// Runs every machine with run_on_executor, the ones in registry->executor
+static TaskHandle_t      executor_task;
+
+// If set, state_post_event() routes inline instead of going through the multiplexer
+static bool              direct_dispatch;
+
+// What posting does when a multiplexer ring is full, counters are atomic
+static state_overflow_e       overflow_policy;
+static TickType_t             overflow_block_ticks;
+static state_overflow_stats_s overflow_stats;
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+// Returns the shard that routes an event
+static inline mux_shard_t* IRAM_ATTR get_shard(state_event_t event) {
+    return &shards[STATE_EVENT_ID(event) % STATE_MUX_SHARDS];
+}
+
+// Returns the lane an event travels in
+static inline int IRAM_ATTR get_lane(state_event_t event) {
+    int lane = STATE_EVENT_PRIO(event);
+    return lane < STATE_LANES ? lane : STATE_LANES - 1;
+}
+
+// Returns how many events a machine's queue and rings hold
+static uint32_t get_inbox_depth(const state_init_s* info) {
+    return info->inbox_depth ? info->inbox_depth : EVENT_QUEUE_MAX_DEPTH;
+}
+
+#if STATE_QUEUE_STATS
+// Counts n events put in a queue, which then held used
+static inline void IRAM_ATTR queue_pushed(queue_stats_t* stats, uint32_t n, uint32_t used) {
+    __atomic_fetch_add(&stats->enqueued, n, __ATOMIC_RELAXED);
+
+    uint32_t high = __atomic_load_n(&stats->high_water, __ATOMIC_RELAXED);
+    while (used > high && !__atomic_compare_exchange_n(&stats->high_water, &high, used, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// Counts an event that found a queue full, the first one starts the clock
+static inline void IRAM_ATTR queue_full(queue_stats_t* stats) {
+    __atomic_fetch_add(&stats->full, 1, __ATOMIC_RELAXED);
+
+    uint32_t since = 0;
+    if (!__atomic_load_n(&stats->full_since, __ATOMIC_RELAXED)) {
+        __atomic_compare_exchange_n(&stats->full_since, &since, (uint32_t)esp_timer_get_time() | 1, false,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+// Counts n events taken out of a queue, which has room again
+static inline void IRAM_ATTR queue_popped(queue_stats_t* stats, uint32_t n) {
+    __atomic_fetch_add(&stats->dequeued, n, __ATOMIC_RELAXED);
+
+    if (__atomic_load_n(&stats->full_since, __ATOMIC_RELAXED)) {
+        uint32_t since = __atomic_exchange_n(&stats->full_since, 0, __ATOMIC_RELAXED);
+        if (since) {
+            __atomic_fetch_add(&stats->full_us, (uint32_t)esp_timer_get_time() - since, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+#define QUEUE_PUSHED(stats, n, used) queue_pushed((stats), (n), (used))
+#define QUEUE_FULL(stats)            queue_full((stats))
+#define QUEUE_POPPED(stats, n)       queue_popped((stats), (n))
+#else
+#define QUEUE_PUSHED(stats, n, used) do { } while (0)
+#define QUEUE_FULL(stats)            do { } while (0)
+#define QUEUE_POPPED(stats, n)       do { } while (0)
+#endif
+
+// Copies a queue's counters to stats, and takes off what was read if reset
+static void queue_read(queue_stats_t* counters, state_queue_stats_s* stats, bool reset) {
+#if STATE_QUEUE_STATS
+    int64_t  now   = esp_timer_get_time();
+    uint32_t since = __atomic_load_n(&counters->full_since, __ATOMIC_RELAXED);
+
+    stats->enqueued   = __atomic_load_n(&counters->enqueued, __ATOMIC_RELAXED);
+    stats->dequeued   = __atomic_load_n(&counters->dequeued, __ATOMIC_RELAXED);
+    stats->full       = __atomic_load_n(&counters->full, __ATOMIC_RELAXED);
+    stats->full_us    = __atomic_load_n(&counters->full_us, __ATOMIC_RELAXED);
+    stats->elapsed_ms = (now - counters->reset_us) / 1000;
+
+    if (reset) {
+        stats->high_water = __atomic_exchange_n(&counters->high_water, 0, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&counters->enqueued, stats->enqueued, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&counters->dequeued, stats->dequeued, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&counters->full, stats->full, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&counters->full_us, stats->full_us, __ATOMIC_RELAXED);
+
+        // Still full, the rest of it counts from now
+        if (since) {
+            __atomic_compare_exchange_n(&counters->full_since, &since, (uint32_t)now | 1, false,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+        counters->reset_us = now;
+    } else {
+        stats->high_water = __atomic_load_n(&counters->high_water, __ATOMIC_RELAXED);
+    }
+
+    // Full right now
+    if (since) {
+        stats->full_us += (uint32_t)now - since;
+    }
+#endif
+}
+
+static void take_shard(mux_shard_t* shard) {
+    if (pdTRUE != xSemaphoreTake(shard->lock, STATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE shard lock!");
+        ASSERT(0);
+    }
+}
+
+// Stops all delivery, always in shard order
+static void take_all_shards() {
+    for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+        take_shard(&shards[i]);
+    }
+}
+
+static void give_all_shards() {
+    for (int i = STATE_MUX_SHARDS - 1; i >= 0; i--) {
+        xSemaphoreGive(shards[i].lock);
+    }
+}
+
+// Starts reading the registry, without a lock. The registry stays valid
+// until registry_exit() is called with the returned epoch. Readers must
+// not block for long, and must never start or stop machines
+static uint32_t registry_enter(registry_t** current) {
+    for (;;) {
+        uint32_t epoch = __atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST) & 1;
+        __atomic_fetch_add(&registry_readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+        // A publish that flipped the epoch in between doesn't wait for us
+        if ((__atomic_load_n(&registry_epoch, __ATOMIC_SEQ_CST) & 1) == epoch) {
+            *current = __atomic_load_n(&registry, __ATOMIC_SEQ_CST);
+            return epoch;
+        }
+        __atomic_fetch_sub(&registry_readers[epoch], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void registry_exit(uint32_t epoch) {
+    __atomic_fetch_sub(&registry_readers[epoch], 1, __ATOMIC_RELEASE);
+}
+
+// Makes next the current registry. New readers go to the other epoch, so
+// once the readers of the old one are out nobody can hold the old registry
+// anymore, and it is freed. Must hold consumer_sem
+static void registry_publish(registry_t* next) {
+    registry_t* old = registry;
+
+    __atomic_store_n(&registry, next, __ATOMIC_SEQ_CST);
+    uint32_t epoch = __atomic_fetch_add(&registry_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&registry_readers[epoch], __ATOMIC_SEQ_CST)) {
+        vTaskDelay(1);
+    }
+    free(old);
+}
+
+// Returns the index of the route for event in a shard's routes, or where
+// it should be inserted if there is no such route (binary search)
+static int find_route(const registry_t* current, int shard, state_event_t event) {
+    const route_t* routes = current->routes[shard];
+    int            low    = 0;
+    int            high   = current->total_routes[shard];
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (routes[mid].event < event) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Adds a subscriber to a registry that is being built
+static void add_route(registry_t* next, state_event_t event, int consumer_index) {
+    int      shard  = get_shard(event) - shards;
+    route_t* routes = next->routes[shard];
+    int      idx    = find_route(next, shard, event);
+
+    if (idx == next->total_routes[shard] || routes[idx].event != event) {
+        if (next->total_routes[shard] >= STATE_MAX_ROUTES) {
+            ESP_LOGE(TAG, "Routing index full, increase STATE_MAX_ROUTES!");
+            ASSERT(0);
+        }
+        memmove(&routes[idx + 1], &routes[idx], (next->total_routes[shard] - idx) * sizeof(route_t));
+        routes[idx].event       = event;
+        routes[idx].subscribers = 0;
+        next->total_routes[shard]++;
+    }
+    routes[idx].subscribers |= ((consumer_mask_t)1 << consumer_index);
+}
+
+// Builds a registry of the machines in live, in one allocation (the routes
+// follow the struct). Must hold consumer_sem
+static registry_t* build_registry(consumer_mask_t live) {
+    int sizes[STATE_MUX_SHARDS] = {0};
+    int total = 0;
+
+    // Room for every subscription, per shard
+    for (consumer_mask_t m = live; m; m &= m - 1) {
+        state_init_s* info = consumers[__builtin_ctzll(m)].info;
+        for (int i = 0; i < info->total_subscribed_events; i++) {
+            sizes[get_shard(info->subscribed_events[i]) - shards]++;
+            total++;
+        }
+    }
+
+    registry_t* next = calloc(1, sizeof(registry_t) + total * sizeof(route_t));
+    ASSERT(next);
+
+    route_t* routes = (route_t*)(next + 1);
+    for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+        next->routes[i] = routes;
+        routes += sizes[i];
+    }
+
+    next->live = live;
+    for (consumer_mask_t m = live; m; m &= m - 1) {
+        int           index = __builtin_ctzll(m);
+        state_init_s* info  = consumers[index].info;
+
+        for (int i = 0; i < info->total_subscribed_events; i++) {
+            add_route(next, info->subscribed_events[i], index);
+        }
+        if (info->filter_event) {
+            next->dynamic |= ((consumer_mask_t)1 << index);
+        }
+        if (info->run_on_executor) {
+            next->executor |= ((consumer_mask_t)1 << index);
+        }
+    }
+    return next;
+}
+
+// Returns all the machines that are statically subscribed to an event
+static consumer_mask_t lookup_route(const registry_t* current, mux_shard_t* shard, state_event_t event) {
+    int index = shard - shards;
+    int idx   = find_route(current, index, event);
+
+    if (idx < current->total_routes[index] && current->routes[index][idx].event == event) {
+        return current->routes[index][idx].subscribers;
+    }
+    return 0;
+}
+
+// Runs the shared executor, which hosts every machine with run_on_executor set
+static void executor(void* v);
+
+// Resolves the parent links of a translation table into per state lookup
+// tables, so dispatch never has to walk states without handlers. Returns
+// NULL for a flat table
+static hierarchy_t* build_hierarchy(state_init_s* info) {
+    const state_array_s* table  = info->translation_table;
+    int                  total  = info->total_states;
+    int                  links  = 0;
+    bool                 nested = false;
+
+    for (int i = 0; i < total; i++) {
+        if (table[i].parent != STATE_NO_PARENT || table[i].state_function_event) {
+            nested = true;
+        }
+    }
+    if (!nested) {
+        return NULL;
+    }
+
+    hierarchy_t* hierarchy = malloc(sizeof(hierarchy_t));
+    ASSERT(hierarchy);
+    hierarchy->parents  = malloc(total * sizeof(state_t));
+    hierarchy->depths   = malloc(total * sizeof(uint8_t));
+    hierarchy->handlers = malloc(total * sizeof(uint16_t));
+    ASSERT(hierarchy->parents && hierarchy->depths && hierarchy->handlers);
+
+    for (int i = 0; i < total; i++) {
+        state_t parent = table[i].parent;
+        if (parent != STATE_NO_PARENT && parent > (state_t)total) {
+            ESP_LOGE(TAG, "State %d has an invalid parent in %s", i, info->state_name_string);
+            ASSERT(0);
+        }
+        hierarchy->parents[i] = parent == STATE_NO_PARENT ? NULL_STATE : parent - 1;
+    }
+
+    // Depths, and the size of every handler chain (plus its terminator)
+    for (int i = 0; i < total; i++) {
+        int depth = 0;
+        links++;
+        for (state_t s = i; s != NULL_STATE; s = hierarchy->parents[s]) {
+            if (depth >= STATE_MAX_DEPTH) {
+                ESP_LOGE(TAG, "State %d is nested too deep (or its own parent) in %s", i, info->state_name_string);
+                ASSERT(0);
+            }
+            if (table[s].state_function_event) {
+                links++;
+            }
+            depth++;
+        }
+        hierarchy->depths[i] = depth - 1;
+    }
+
+    hierarchy->chain = malloc(links * sizeof(event_handler_ptr));
+    ASSERT(hierarchy->chain);
+
+    links = 0;
+    for (int i = 0; i < total; i++) {
+        hierarchy->handlers[i] = links;
+        for (state_t s = i; s != NULL_STATE; s = hierarchy->parents[s]) {
+            if (table[s].state_function_event) {
+                hierarchy->chain[links++] = table[s].state_function_event;
+            }
+        }
+        hierarchy->chain[links++] = NULL;
+    }
+    return hierarchy;
+}
+
+// Compiles a transition table into a dense state x event lookup table.
+// Returns NULL if there is no table
+static transitions_t* compile_transitions(state_init_s* info, hierarchy_t* hierarchy) {
+    const state_transition_s* rows  = info->transitions;
+    int                       total = info->total_transitions;
+
+    if (!rows || total == 0) {
+        return NULL;
+    }
+
+    if (total >= UINT16_MAX) {
+        ESP_LOGE(TAG, "Too many transitions in %s!", info->state_name_string);
+        ASSERT(0);
+    }
+
+    // Events are remapped to columns, by their offset from the lowest one
+    state_event_t first = rows[0].event;
+    state_event_t last  = rows[0].event;
+    for (int i = 0; i < total; i++) {
+        if (rows[i].state >= (state_t)info->total_states ||
+            (rows[i].next != NULL_STATE && rows[i].next >= (state_t)info->total_states)) {
+            ESP_LOGE(TAG, "Transition %d out of bounds in %s", i, info->state_name_string);
+            ASSERT(0);
+        }
+        first = rows[i].event < first ? rows[i].event : first;
+        last  = rows[i].event > last  ? rows[i].event : last;
+    }
+
+    if (last - first >= STATE_MAX_EVENT_SPAN) {
+        ESP_LOGE(TAG, "Transition events span too far in %s, increase STATE_MAX_EVENT_SPAN!", info->state_name_string);
+        ASSERT(0);
+    }
+
+    transitions_t* table = malloc(sizeof(transitions_t));
+    ASSERT(table);
+    table->first_event   = first;
+    table->span          = last - first + 1;
+    table->total_columns = 0;
+    table->columns       = calloc(table->span, sizeof(uint16_t));
+    ASSERT(table->columns);
+
+    for (int i = 0; i < total; i++) {
+        uint16_t* column = &table->columns[rows[i].event - first];
+        if (!*column) {
+            *column = ++table->total_columns;
+        }
+    }
+
+    table->cells     = calloc(info->total_states * table->total_columns, sizeof(uint16_t));
+    table->next_rows = calloc(total, sizeof(uint16_t));
+    ASSERT(table->cells && table->next_rows);
+
+    // Link the rows of every cell, in table order
+    for (int i = total - 1; i >= 0; i--) {
+        uint16_t* cell = &table->cells[rows[i].state * table->total_columns + table->columns[rows[i].event - first] - 1];
+        table->next_rows[i] = *cell;
+        *cell = i + 1;
+    }
+
+    // Children inherit the rows of their parents, parents are filled in first
+    for (int depth = 1; hierarchy && depth < STATE_MAX_DEPTH; depth++) {
+        for (int state = 0; state < info->total_states; state++) {
+            if (hierarchy->depths[state] != depth) {
+                continue;
+            }
+
+            uint16_t* cells  = &table->cells[state * table->total_columns];
+            uint16_t* parent = &table->cells[hierarchy->parents[state] * table->total_columns];
+            for (int column = 0; column < table->total_columns; column++) {
+                if (!cells[column]) {
+                    cells[column] = parent[column];
+                }
+            }
+        }
+    }
+    return table;
+}
+
+static machine_t* add_event_consumer(state_init_s* thread_info) {
+    ESP_LOGI(TAG, "Adding new state machine, name = %s", thread_info->state_name_string);
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    // Lowest free slot, stopped machines leave theirs behind
+    consumer_mask_t free_slots = ~registry->live;
+#if STATE_MAX_MACHINES < 64
+    free_slots &= ((consumer_mask_t)1 << STATE_MAX_MACHINES) - 1;
+#endif
+    if (!free_slots) {
+        ESP_LOGE(TAG, "Too many state machines, increase STATE_MAX_MACHINES!");
+        ASSERT(0);
+    }
+
+    int        index   = __builtin_ctzll(free_slots);
+    machine_t* machine = &consumers[index];
+    machine->info        = thread_info;
+    machine->inbox_depth = get_inbox_depth(thread_info);
+    machine->state       = thread_info->starting_state;
+    machine->hierarchy   = build_hierarchy(thread_info);
+    machine->transitions = compile_transitions(thread_info, machine->hierarchy);
+    STATE_TRACE_NAME(index, thread_info->state_name_string);
+
+    // Event flags coalesce by themselves
+    if (thread_info->total_coalesced_events && thread_info->inbox != STATE_INBOX_NOTIFY) {
+        machine->coalesce = calloc(thread_info->total_coalesced_events, sizeof(coalesce_t));
+        ASSERT(machine->coalesce);
+        for (int i = 0; i < thread_info->total_coalesced_events; i++) {
+            machine->coalesce[i].event = thread_info->coalesced_events[i];
+        }
+        machine->total_coalesce = thread_info->total_coalesced_events;
+    }
+
+#if STATE_LATENCY
+    machine->stats = calloc(1, sizeof(state_stats_s));
+    ASSERT(machine->stats);
+#endif
+#if STATE_PROFILE
+    machine->profile = calloc(thread_info->total_states, sizeof(profile_t));
+    ASSERT(machine->profile);
+#endif
+
+    // A queue inbox keeps normal events in its queue
+    if (thread_info->inbox != STATE_INBOX_NOTIFY) {
+        for (int lane = thread_info->inbox == STATE_INBOX_QUEUE; lane < STATE_LANES; lane++) {
+            for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+                bool ok = state_ring_init(&machine->rings[lane][i], machine->inbox_depth);
+                ASSERT(ok);
+            }
+        }
+    }
+
+    machine->queue_stats.reset_us = esp_timer_get_time();
+
+    // Routing sees the machine from here on
+    registry_publish(build_registry(registry->live | ((consumer_mask_t)1 << index)));
+
+    if (thread_info->run_on_executor) {
+        if (!executor_task) {
+            BaseType_t rc = xTaskCreate(executor,
+                                        "state_executor",
+                                        STATE_EXECUTOR_STACK_DEPTH,
+                                        NULL,
+                                        STATE_MACHINE_PRIORITY,
+                                        &executor_task);
+            if (rc != pdPASS) {
+                ASSERT(0);
+            }
+        }
+
+        // Run the starting state
+        xTaskNotifyGive(executor_task);
+    }
+
+    xSemaphoreGive(consumer_sem);
+    return machine;
+}
+
+// Returns the state function, given a state
+static state_array_s get_state_table(state_init_s * state_ptr, state_t state) {
+    
+    if (state >= state_ptr->total_states) {
+        ESP_LOGE(TAG, "Current state (%d) out of bounds in %s", state, state_ptr->state_name_string);
+        ASSERT(0);
+    }
+    return state_ptr->translation_table[state];
+}
+
+
+// used to read from events sent to this state machine, stamp gets when
+// it was queued (STATE_LATENCY only)
+static state_event_t get_event_generic(QueueHandle_t q_handle, uint32_t timeout, uint32_t* stamp) {
+    if (!q_handle){
+      ESP_LOGE(TAG, "NULL HANDLE!");
+      ASSERT(0);
+    }
+    queue_item_t item = { .event = INVALID_EVENT };
+    xQueueReceive(q_handle, &item, timeout);
+#if STATE_LATENCY
+    *stamp = item.stamp;
+#endif
+    return item.event;
+}
+
+// Never blocks, returns false if the queue is full
+static bool send_event_generic(QueueHandle_t q_handle, state_event_t event) {
+    if (!q_handle){
+      ESP_LOGE(TAG, "NULL HANDLE!");
+      ASSERT(0);
+    }
+
+    queue_item_t item = {
+        .event = event,
+#if STATE_LATENCY
+        .stamp = STATE_LATENCY_NOW(),
+#endif
+    };
+    return xQueueSendToBack(q_handle, &item, RTOS_DONT_WAIT) == pdTRUE;
+}
+
+// Wakes up the task reading a machine's inbox
+static void inbox_wake(machine_t* machine) {
+    TaskHandle_t task = machine->info->run_on_executor ? executor_task : machine->task;
+
+    // No task yet, it will check the inbox when it starts
+    if (task) {
+        xTaskNotifyGive(task);
+    }
+}
+
+// Returns the notification bit of an event, its index in subscribed_events
+static uint32_t notify_bit(state_init_s* info, state_event_t id) {
+    for (int i = 0; i < info->total_subscribed_events; i++) {
+        if (info->subscribed_events[i] == id) {
+            return (uint32_t)1 << i;
+        }
+    }
+
+    ESP_LOGE(TAG, "Event %d has no notification bit in %s!", id, info->state_name_string);
+    ASSERT(0);
+    return 0;
+}
+
+// Wakes up the task of a queue inbox for an event in one of its rings. The
+// task only blocks on the queue, and only once the queue is empty, so a
+// marker is only needed then (if it doesn't fit, there is plenty to wake it)
+static void queue_wake(machine_t* machine) {
+    QueueHandle_t queue = machine->info->state_queue_input_handle_private;
+    queue_item_t  wake  = { .event = STATE_EVENT_WAKE };
+
+    // Hosted machines are polled by the executor
+    if (machine->info->run_on_executor) {
+        return;
+    }
+
+    if (uxQueueMessagesWaiting(queue) == 0) {
+        xQueueSendToBack(queue, &wake, RTOS_DONT_WAIT);
+    }
+}
+
+// Sets an event's bit in a STATE_INBOX_NOTIFY machine, must hold the shard
+// lock. Returns false if the bit was already set
+static bool notify_send(machine_t* machine, state_event_t event, int lane) {
+    uint32_t bit = notify_bit(machine->info, STATE_EVENT_ID(event));
+
+    // Only the event ID fits in a bit
+    state_payload_release(STATE_EVENT_PAYLOAD(event));
+
+    // Marked before it can be received, so it is taken first
+    if (lane) {
+        __atomic_fetch_or(&machine->notify_lanes[lane], bit, __ATOMIC_RELAXED);
+    }
+
+    // No task yet, keep it until start_new_state_machine() hands it over
+    uint32_t before = 0;
+    if (!machine->task) {
+        before = __atomic_fetch_or(&machine->notify_bits, bit, __ATOMIC_RELAXED);
+    } else {
+        xTaskNotifyAndQuery(machine->task, bit, eSetBits, &before);
+    }
+    return !(before & bit);
+}
+
+// Waits up to timeout for an event in a STATE_INBOX_NOTIFY machine,
+// returns INVALID_EVENT on a timeout
+static state_event_t notify_receive(machine_t* machine, TickType_t timeout) {
+    if (!machine->notify_pending) {
+        uint32_t bits = 0;
+        if (machine->stopping || xTaskNotifyWait(0, UINT32_MAX, &bits, timeout) != pdTRUE || bits == 0) {
+            return INVALID_EVENT;
+        }
+        machine->notify_pending = bits;
+    }
+
+    // Pending events of the highest lane first
+    uint32_t bits = machine->notify_pending;
+    int      lane = STATE_LANES - 1;
+    for (; lane > 0; lane--) {
+        uint32_t marked = bits & __atomic_load_n(&machine->notify_lanes[lane], __ATOMIC_RELAXED);
+        if (marked) {
+            bits = marked;
+            break;
+        }
+    }
+
+    int bit = __builtin_ctz(bits);
+    machine->notify_pending &= ~((uint32_t)1 << bit);
+    for (; lane > 0; lane--) {
+        __atomic_fetch_and(&machine->notify_lanes[lane], ~((uint32_t)1 << bit), __ATOMIC_RELAXED);
+    }
+    return machine->info->subscribed_events[bit];
+}
+
+// Returns the coalescing entry of an event, NULL if the machine doesn't
+// coalesce it
+static coalesce_t* find_coalesce(machine_t* machine, state_event_t event) {
+    for (int i = 0; i < machine->total_coalesce; i++) {
+        if (machine->coalesce[i].event == event) {
+            return &machine->coalesce[i];
+        }
+    }
+    return NULL;
+}
+
+// Delivers an event to a machine's inbox, in the lane of its priority. Must
+// hold the shard lock (the shard is the only producer of its rings). Ring
+// machines have to be woken up with inbox_wake() once the batch is in.
+// Returns false if the event was dropped, or absorbed by a waiting copy
+static bool inbox_send(machine_t* machine, mux_shard_t* shard, state_event_t event) {
+    state_init_s* info = machine->info;
+    int           lane = get_lane(event);
+
+    // The lane keeps the priority from here on
+    event &= ~STATE_EVENT_PRIO_MASK;
+
+    // Traced before the machine can see the event
+    if (info->inbox == STATE_INBOX_NOTIFY) {
+        STATE_TRACE_RECORD(STATE_TRACE_ENQUEUE, machine - consumers, lane, event);
+        // A copy still waiting has the bit already, and is received once
+        if (notify_send(machine, event, lane)) {
+            QUEUE_PUSHED(&machine->queue_stats, 1, 0);
+        }
+        return true;
+    }
+
+    // An event always goes through the same shard, so we are its only
+    // sender and waiting can only drop behind our back
+    coalesce_t* entry = find_coalesce(machine, event);
+    if (entry) {
+        // The waiting copy stands in for this one, urgent copies still go
+        if (lane == 0 && __atomic_load_n(&entry->waiting, __ATOMIC_ACQUIRE)) {
+            __atomic_fetch_add(&machine->coalesced, 1, __ATOMIC_RELAXED);
+            return false;
+        }
+        __atomic_fetch_add(&entry->waiting, 1, __ATOMIC_RELAXED);
+    }
+    STATE_TRACE_RECORD(STATE_TRACE_ENQUEUE, machine - consumers, lane, event);
+
+    // Never wait for a slow machine, that would hold up every other one.
+    // What doesn't fit goes to its backlog, and once that has events,
+    // everything from this shard queues up behind them
+    state_ring_t* backlog = &machine->backlog[lane][shard - shards];
+    bool          sent    = false;
+    if (state_ring_count(backlog) == 0) {
+        if (info->inbox == STATE_INBOX_QUEUE && lane == 0) {
+            sent = send_event_generic(info->state_queue_input_handle_private, event);
+            if (sent) {
+                QUEUE_PUSHED(&machine->queue_stats, 1, uxQueueMessagesWaiting(info->state_queue_input_handle_private));
+            }
+        } else {
+            sent = state_ring_push(&machine->rings[lane][shard - shards], event);
+            if (sent) {
+                QUEUE_PUSHED(&machine->queue_stats, 1, state_ring_count(&machine->rings[lane][shard - shards]));
+            }
+        }
+    }
+
+    if (!sent) {
+        QUEUE_FULL(&machine->queue_stats);
+
+        // First time behind, the ring is published by its first push
+        if (!backlog->buffer) {
+            state_ring_init(backlog, STATE_BACKLOG_DEPTH);
+        }
+
+        if (!backlog->buffer || !state_ring_push(backlog, event)) {
+            STATE_LOGW(STATE_LOG_DROPPED, info->state_name_string, STATE_EVENT_ID(event), 0);
+            STATE_TRACE_RECORD(STATE_TRACE_DROP, machine - consumers, lane, event);
+            __atomic_fetch_add(&machine->lag_dropped, 1, __ATOMIC_RELAXED);
+            state_payload_release(STATE_EVENT_PAYLOAD(event));
+            if (entry) {
+                __atomic_fetch_sub(&entry->waiting, 1, __ATOMIC_RELAXED);
+            }
+            return false;
+        }
+        __atomic_fetch_add(&machine->lag_deferred, 1, __ATOMIC_RELAXED);
+        QUEUE_PUSHED(&machine->queue_stats, 1, 0);
+    }
+
+    // The task of a queue inbox only watches its queue
+    if (info->inbox == STATE_INBOX_QUEUE && (lane || !sent)) {
+        queue_wake(machine);
+    }
+    return true;
+}
+
+// Pops the oldest event of one lane, taking turns between the shards' rings.
+// A shard's backlog comes after its ring (a queue inbox has no normal ring)
+static bool lane_pop(machine_t* machine, int lane, state_event_t* event) {
+    for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+        int ring = (machine->next_ring + i) % STATE_MUX_SHARDS;
+        if (state_ring_pop_stamped(&machine->rings[lane][ring], event, &machine->inbox_stamp) ||
+            state_ring_pop_stamped(&machine->backlog[lane][ring], event, &machine->inbox_stamp)) {
+            machine->next_ring = (ring + 1) % STATE_MUX_SHARDS;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Pops the next event from a machine's rings, highest lane first, down
+// to lane lowest. Counts the run of higher lane events
+static bool rings_pop(machine_t* machine, int lowest, state_event_t* event) {
+    for (int lane = STATE_LANES - 1; lane >= lowest; lane--) {
+        if (!lane_pop(machine, lane, event)) {
+            continue;
+        }
+
+        if (lane == 0) {
+            machine->lane_run = 0;
+        } else if (machine->lane_run < STATE_LANE_STARVE_MAX) {
+            machine->lane_run++;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Ticks left of timeout since start, 0 once it has passed
+static TickType_t time_left(TickType_t start, TickType_t timeout) {
+    if (timeout == portMAX_DELAY) {
+        return portMAX_DELAY;
+    }
+
+    TickType_t elapsed = xTaskGetTickCount() - start;
+    return elapsed >= timeout ? 0 : timeout - elapsed;
+}
+
+// Pops the next normal event of a STATE_INBOX_QUEUE machine, the queue
+// first, then the backlog of what came after it was full
+static bool normal_pop(machine_t* machine, state_event_t* event) {
+    do {
+        *event = get_event_generic(machine->info->state_queue_input_handle_private, RTOS_DONT_WAIT, &machine->inbox_stamp);
+    } while (*event == STATE_EVENT_WAKE);
+
+    return *event != INVALID_EVENT || lane_pop(machine, 0, event);
+}
+
+// Waits up to timeout for an event in a STATE_INBOX_QUEUE machine, normal
+// events come from the queue, higher lanes from the rings.
+// Returns INVALID_EVENT on a timeout
+static state_event_t queue_receive(machine_t* machine, TickType_t timeout) {
+    TickType_t    start = xTaskGetTickCount();
+    state_event_t new_event;
+
+    for (;;) {
+        // A normal event goes next once the higher lanes had their run
+        if (machine->lane_run >= STATE_LANE_STARVE_MAX && normal_pop(machine, &new_event)) {
+            machine->lane_run = 0;
+            return new_event;
+        }
+
+        if (rings_pop(machine, 1, &new_event)) {
+            return new_event;
+        }
+
+        if (normal_pop(machine, &new_event)) {
+            machine->lane_run = 0;
+            return new_event;
+        }
+
+        // Nothing anywhere, block on the queue, a marker means look again
+        TickType_t wait = time_left(start, timeout);
+        if (wait == 0 || machine->stopping) {
+            return INVALID_EVENT;
+        }
+
+        new_event = get_event_generic(machine->info->state_queue_input_handle_private, wait, &machine->inbox_stamp);
+        if (new_event != STATE_EVENT_WAKE) {
+            if (new_event != INVALID_EVENT) {
+                machine->lane_run = 0;
+            }
+            return new_event;
+        }
+    }
+}
+
+// Waits up to timeout for an event in a STATE_INBOX_RING machine,
+// returns INVALID_EVENT on a timeout
+static state_event_t ring_receive(machine_t* machine, TickType_t timeout) {
+    TickType_t start = xTaskGetTickCount();
+    for (;;) {
+        state_event_t new_event;
+
+        // A normal event goes next once the higher lanes had their run
+        if (machine->lane_run >= STATE_LANE_STARVE_MAX && lane_pop(machine, 0, &new_event)) {
+            machine->lane_run = 0;
+            return new_event;
+        }
+
+        if (rings_pop(machine, 0, &new_event)) {
+            return new_event;
+        }
+
+        // Polling, also keeps us off the executor's notifications
+        if (timeout == RTOS_DONT_WAIT) {
+            return INVALID_EVENT;
+        }
+
+        // Sleep until a producer wakes us, but no longer than timeout overall
+        TickType_t wait = time_left(start, timeout);
+        if (wait == 0 || machine->stopping) {
+            return INVALID_EVENT;
+        }
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+// Waits up to timeout for an event in a machine's inbox, returns
+// INVALID_EVENT on a timeout. Never blocks once the machine is stopping
+static state_event_t inbox_receive(machine_t* machine, TickType_t timeout) {
+    state_event_t new_event;
+
+    switch (machine->info->inbox) {
+    case STATE_INBOX_NOTIFY:
+        new_event = notify_receive(machine, timeout);
+        if (new_event != INVALID_EVENT) {
+            QUEUE_POPPED(&machine->queue_stats, 1);
+        }
+        return new_event;
+
+    case STATE_INBOX_RING:
+        new_event = ring_receive(machine, timeout);
+        break;
+
+    default:
+        new_event = queue_receive(machine, timeout);
+        break;
+    }
+
+    if (new_event != INVALID_EVENT) {
+        QUEUE_POPPED(&machine->queue_stats, 1);
+    }
+
+    // Out of the inbox, copies posted from now on have to be queued again
+    coalesce_t* entry = new_event != INVALID_EVENT ? find_coalesce(machine, new_event) : NULL;
+    if (entry) {
+        __atomic_fetch_sub(&entry->waiting, 1, __ATOMIC_RELEASE);
+    }
+    return new_event;
+}
+
+#if STATE_LATENCY
+// Adds a time to one of a machine's histograms
+static void latency_record(machine_t* machine, state_latency_e leg, uint32_t us) {
+    state_histogram_s* histogram = &machine->stats->latency[leg];
+    int                bucket    = us ? 32 - __builtin_clz(us) : 0;
+
+    if (bucket >= STATE_LATENCY_BUCKETS) {
+        bucket = STATE_LATENCY_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+    uint32_t max = __atomic_load_n(&histogram->max_us, __ATOMIC_RELAXED);
+    while (us > max && !__atomic_compare_exchange_n(&histogram->max_us, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+#endif
+
+// Returns every machine interested in an event
+static consumer_mask_t get_targets(const registry_t* current, mux_shard_t* shard, state_event_t id) {
+    // Look up who subscribed to this event, then let any machines
+    // with a dynamic filter claim it
+    consumer_mask_t targets = lookup_route(current, shard, id);
+    consumer_mask_t dynamic = current->dynamic & ~targets;
+    while (dynamic) {
+        int index = __builtin_ctzll(dynamic);
+        dynamic &= dynamic - 1;
+
+        if (consumers[index].info->filter_event(id)) {
+            targets |= ((consumer_mask_t)1 << index);
+        }
+    }
+    return targets;
+}
+
+// Sends a batch of events, all belonging to shard, to all state machines
+// that have registered for them. The registry is read without a lock, the
+// shard lock is only held while delivering. Each machine gets its events
+// back to back, in the order they were posted. stamps are when they were
+// posted (see STATE_LATENCY), NULL if just now.
+// n must be <= STATE_MUX_DRAIN_MAX
+static void route_events(mux_shard_t* shard, const state_event_t* events, const uint32_t* stamps, size_t n) {
+    consumer_mask_t targets[STATE_MUX_DRAIN_MAX];
+    consumer_mask_t all_targets = 0;
+    registry_t*     current;
+    uint32_t        epoch = registry_enter(&current);
+#if STATE_LATENCY
+    uint32_t        taken = STATE_LATENCY_NOW();
+#endif
+
+    STATE_TRACE_RECORD(STATE_TRACE_ROUTE_BEGIN, STATE_TRACE_NO_MACHINE, shard - shards, events[0]);
+    for (size_t i = 0; i < n; i++) {
+        targets[i]   = get_targets(current, shard, STATE_EVENT_ID(events[i]));
+        all_targets |= targets[i];
+    }
+    consumer_mask_t delivered = all_targets;
+
+    take_shard(shard);
+
+    while (all_targets) {
+        int             index = __builtin_ctzll(all_targets);
+        consumer_mask_t bit   = (consumer_mask_t)1 << index;
+        machine_t*      machine  = &consumers[index];
+        state_init_s*   consumer = machine->info;
+        all_targets &= all_targets - 1;
+
+        for (size_t i = 0; i < n; i++) {
+            if (!(targets[i] & bit)) {
+                continue;
+            }
+
+            // Each subscriber holds its own reference to the payload
+            state_payload_retain(STATE_EVENT_PAYLOAD(events[i]));
+
+            STATE_LOGI(STATE_LOG_SENT, consumer->state_name_string, STATE_EVENT_ID(events[i]), 0);
+#if STATE_LATENCY
+            if (inbox_send(machine, shard, events[i])) {
+                latency_record(machine, STATE_LATENCY_INGRESS, stamps ? taken - stamps[i] : 0);
+                latency_record(machine, STATE_LATENCY_DISPATCH, STATE_LATENCY_NOW() - taken);
+            }
+#else
+            inbox_send(machine, shard, events[i]);
+#endif
+        }
+
+        // One wakeup per batch
+        if (consumer->inbox == STATE_INBOX_RING) {
+            inbox_wake(machine);
+        }
+    }
+
+    // Hosted machines have no task to wake up, let the executor poll them
+    if (executor_task && (delivered & current->executor)) {
+        xTaskNotifyGive(executor_task);
+    }
+    xSemaphoreGive(shard->lock);
+    registry_exit(epoch);
+    STATE_TRACE_RECORD(STATE_TRACE_ROUTE_END, STATE_TRACE_NO_MACHINE, shard - shards, n);
+
+    // Drop the posters' references, frees payloads nobody subscribed to
+    for (size_t i = 0; i < n; i++) {
+        state_payload_release(STATE_EVENT_PAYLOAD(events[i]));
+    }
+}
+
+// Wakes up a shard's multiplexer if it is blocked, called after pushing
+// to its ring. Producers skip the notification while the multiplexer is
+// busy draining, so a burst costs one wakeup. Returns true from an ISR if
+// a higher priority task was woken.
+static inline BaseType_t IRAM_ATTR wake_multiplexer(mux_shard_t* shard, bool from_isr) {
+    BaseType_t woken = pdFALSE;
+
+    if (__atomic_exchange_n(&shard->sleeping, 0, __ATOMIC_SEQ_CST)) {
+        if (from_isr) {
+            vTaskNotifyGiveFromISR(shard->task, &woken);
+        } else {
+            xTaskNotifyGive(shard->task);
+        }
+    }
+    return woken;
+}
+
+// Pops the oldest posted event of one lane, spilled events come after the
+// ring (they are newer than anything in it)
+static bool lane_pop_incoming(mux_shard_t* shard, int lane, state_event_t* event, uint32_t* stamp) {
+    if (state_mpsc_pop_stamped(&shard->incoming[lane], event, stamp)) {
+        return true;
+    }
+    return shard->spill[lane].slots && state_mpsc_pop_stamped(&shard->spill[lane], event, stamp);
+}
+
+// Pops the next posted event of a shard, highest lane first, with the
+// same starvation limit as the inboxes. stamp gets when it was posted
+// (see STATE_LATENCY). Multiplexer only
+static bool incoming_pop(mux_shard_t* shard, state_event_t* event, uint32_t* stamp) {
+    // A normal event goes next once the higher lanes had their run
+    if (shard->lane_run >= STATE_LANE_STARVE_MAX && lane_pop_incoming(shard, 0, event, stamp)) {
+        shard->lane_run = 0;
+        return true;
+    }
+
+    for (int lane = STATE_LANES - 1; lane >= 0; lane--) {
+        if (!lane_pop_incoming(shard, lane, event, stamp)) {
+            continue;
+        }
+
+        if (lane == 0) {
+            shard->lane_run = 0;
+        } else if (shard->lane_run < STATE_LANE_STARVE_MAX) {
+            shard->lane_run++;
+        }
+        return true;
+    }
+    return false;
+}
+
+// Reads from a shard's rings and sends the event
+// to all state machines that have registered for the event
+static void event_multiplexer(void* v) {
+    mux_shard_t* shard = (mux_shard_t*)v;
+
+    ESP_LOGI(TAG, "Starting event event_multiplexer %d", (int)(shard - shards));
+    for (;;) {
+        state_event_t events[STATE_MUX_DRAIN_MAX];
+        uint32_t      stamps[STATE_MUX_DRAIN_MAX];
+        size_t        count = 0;
+
+        // Route whatever is pending in one go
+        while (count < STATE_MUX_DRAIN_MAX && incoming_pop(shard, &events[count], &stamps[count])) {
+            count++;
+        }
+
+        if (count == 0) {
+            // Announce we are going to sleep, then look again: a producer
+            // either sees the flag and notifies us, or published before
+            // it and we find its event here
+            __atomic_store_n(&shard->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (incoming_pop(shard, &events[0], &stamps[0])) {
+                __atomic_store_n(&shard->sleeping, 0, __ATOMIC_SEQ_CST);
+                count = 1;
+            } else {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
+        }
+
+        STATE_LOGI(STATE_LOG_ROUTED, "event_mux", (int)count, events[0]);
+        QUEUE_POPPED(&shard->queue_stats, count);
+        route_events(shard, events, stamps, count);
+    }
+}
+
+static void state_core_init_freertos_objects() {
+    //Reads and Pushes events from state-machines
+    for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+        shards[i].lock = xSemaphoreCreateMutex();
+        shards[i].queue_stats.reset_us = esp_timer_get_time();
+
+        // make sure nothing is NULL!
+        for (int lane = 0; lane < STATE_LANES; lane++) {
+            ASSERT(state_mpsc_init(&shards[i].incoming[lane], INCOMING_QUEUE_MAX_DEPTH));
+        }
+        ASSERT(shards[i].lock);
+    }
+    consumer_sem = xSemaphoreCreateMutex();
+    ASSERT(consumer_sem);
+
+    // Nothing registered yet
+    registry = build_registry(0);
+}
+
+void state_core_set_direct_dispatch(bool enable) {
+    ESP_LOGI(TAG, "Direct dispatch %s", enable ? "enabled" : "disabled");
+    direct_dispatch = enable;
+}
+
+void state_post_event_with_payload(state_event_t event, state_payload_t payload) {
+    if (STATE_EVENT_PAYLOAD(event) != STATE_PAYLOAD_NONE) {
+        ESP_LOGE(TAG, "Event %d already carries a payload!", event);
+        ASSERT(0);
+    }
+    state_post_event(event | ((state_event_t)payload << STATE_EVENT_PAYLOAD_SHIFT));
+}
+
+void state_core_set_overflow_policy(state_overflow_e policy, TickType_t block_ticks) {
+    // Spill rings stay once they exist, the multiplexer may be reading them
+    if (policy == STATE_OVERFLOW_SPILL) {
+        for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+            for (int lane = 0; lane < STATE_LANES; lane++) {
+                if (!shards[i].spill[lane].slots) {
+                    ASSERT(state_mpsc_init(&shards[i].spill[lane], STATE_SPILL_DEPTH));
+                }
+            }
+        }
+        __sync_synchronize();
+    }
+
+    overflow_block_ticks = block_ticks;
+    overflow_policy      = policy;
+}
+
+void state_core_get_overflow_stats(state_overflow_stats_s* stats, bool reset) {
+    if (!stats) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    stats->overflows = __atomic_load_n(&overflow_stats.overflows, __ATOMIC_RELAXED);
+    stats->dropped   = __atomic_load_n(&overflow_stats.dropped, __ATOMIC_RELAXED);
+    stats->coalesced = __atomic_load_n(&overflow_stats.coalesced, __ATOMIC_RELAXED);
+    stats->spilled   = __atomic_load_n(&overflow_stats.spilled, __ATOMIC_RELAXED);
+    stats->blocked   = __atomic_load_n(&overflow_stats.blocked, __ATOMIC_RELAXED);
+
+    // Counts that come in while we clear are lost, good enough for sizing
+    if (reset) {
+        __atomic_fetch_sub(&overflow_stats.overflows, stats->overflows, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&overflow_stats.dropped, stats->dropped, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&overflow_stats.coalesced, stats->coalesced, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&overflow_stats.spilled, stats->spilled, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&overflow_stats.blocked, stats->blocked, __ATOMIC_RELAXED);
+    }
+}
+
+// True while a lane has spilled events waiting, new events
+// have to queue up behind them
+static inline bool IRAM_ATTR spill_pending(mux_shard_t* shard, int lane) {
+    return shard->spill[lane].slots && state_mpsc_count(&shard->spill[lane]);
+}
+
+// Called when an event doesn't fit in its multiplexer ring, applies the
+// overflow policy. Returns false if the event was dropped
+static bool IRAM_ATTR ingress_overflow(mux_shard_t* shard, state_event_t event, bool from_isr) {
+    int                lane = get_lane(event);
+    state_mpsc_ring_t* ring = &shard->incoming[lane];
+    state_event_t      oldest;
+
+    __atomic_fetch_add(&overflow_stats.overflows, 1, __ATOMIC_RELAXED);
+    QUEUE_FULL(&shard->queue_stats);
+
+    switch (overflow_policy) {
+    case STATE_OVERFLOW_BLOCK:
+        if (from_isr) {
+            break;
+        }
+
+        __atomic_fetch_add(&overflow_stats.blocked, 1, __ATOMIC_RELAXED);
+        for (TickType_t start = xTaskGetTickCount(); xTaskGetTickCount() - start < overflow_block_ticks;) {
+            vTaskDelay(1);
+            if (!spill_pending(shard, lane) && state_mpsc_push(ring, &event, 1)) {
+                QUEUE_PUSHED(&shard->queue_stats, 1, state_mpsc_count(ring));
+                return true;
+            }
+        }
+        break;
+
+    case STATE_OVERFLOW_COALESCE:
+        if (state_mpsc_contains(ring, event)) {
+            __atomic_fetch_add(&overflow_stats.coalesced, 1, __ATOMIC_RELAXED);
+
+            // The waiting one carries the payload for both
+            state_payload_release(STATE_EVENT_PAYLOAD(event));
+            return true;
+        }
+        // fall through, keep the newest
+
+    case STATE_OVERFLOW_DROP_OLDEST:
+        // Someone else may take the freed slot first, then the new one goes
+        if (state_mpsc_pop(ring, &oldest)) {
+            __atomic_fetch_add(&overflow_stats.dropped, 1, __ATOMIC_RELAXED);
+            STATE_TRACE_RECORD(STATE_TRACE_DROP, STATE_TRACE_NO_MACHINE, lane, oldest);
+            state_payload_release(STATE_EVENT_PAYLOAD(oldest));
+            QUEUE_POPPED(&shard->queue_stats, 1);
+            if (state_mpsc_push(ring, &event, 1)) {
+                QUEUE_PUSHED(&shard->queue_stats, 1, state_mpsc_count(ring));
+                return true;
+            }
+        }
+        break;
+
+    case STATE_OVERFLOW_SPILL:
+        if (state_mpsc_push(&shard->spill[lane], &event, 1)) {
+            __atomic_fetch_add(&overflow_stats.spilled, 1, __ATOMIC_RELAXED);
+            QUEUE_PUSHED(&shard->queue_stats, 1, state_mpsc_count(ring) + state_mpsc_count(&shard->spill[lane]));
+            return true;
+        }
+        break;
+
+    case STATE_OVERFLOW_ASSERT:
+        // ESP_LOGE and ASSERT would block in an ISR
+        if (from_isr) {
+            break;
+        }
+        ESP_LOGE(TAG, "Failed to enqueue to event event_multiplexer!");
+        ASSERT(0);
+        break;
+
+    default:
+        break;
+    }
+
+    __atomic_fetch_add(&overflow_stats.dropped, 1, __ATOMIC_RELAXED);
+    STATE_TRACE_RECORD(STATE_TRACE_DROP, STATE_TRACE_NO_MACHINE, lane, event);
+    state_payload_release(STATE_EVENT_PAYLOAD(event));
+    return false;
+}
+
+// Pushes an event to its multiplexer ring, or hands it to the overflow
+// policy. Returns false if the event was dropped
+static inline bool IRAM_ATTR ingress_push(mux_shard_t* shard, state_event_t event, bool from_isr) {
+    int lane = get_lane(event);
+
+    if (!spill_pending(shard, lane) && state_mpsc_push(&shard->incoming[lane], &event, 1)) {
+        QUEUE_PUSHED(&shard->queue_stats, 1, state_mpsc_count(&shard->incoming[lane]));
+        return true;
+    }
+    return ingress_overflow(shard, event, from_isr);
+}
+
+bool state_try_post_event(state_event_t event) {
+    mux_shard_t* shard = get_shard(event);
+    int          lane  = get_lane(event);
+
+    STATE_TRACE_RECORD(STATE_TRACE_POST, STATE_TRACE_NO_MACHINE, 0, event);
+
+    // Route from the posting task, skipping the multiplexer hop
+    if (direct_dispatch) {
+        route_events(shard, &event, NULL, 1);
+        return true;
+    }
+
+    if (spill_pending(shard, lane) || !state_mpsc_push(&shard->incoming[lane], &event, 1)) {
+        QUEUE_FULL(&shard->queue_stats);
+        return false;
+    }
+    QUEUE_PUSHED(&shard->queue_stats, 1, state_mpsc_count(&shard->incoming[lane]));
+    wake_multiplexer(shard, false);
+    return true;
+}
+
+void state_post_event(state_event_t event) {
+    mux_shard_t* shard = get_shard(event);
+
+    STATE_TRACE_RECORD(STATE_TRACE_POST, STATE_TRACE_NO_MACHINE, 0, event);
+
+    // Route from the posting task, skipping the multiplexer hop
+    if (direct_dispatch) {
+        route_events(shard, &event, NULL, 1);
+        return;
+    }
+
+    if (ingress_push(shard, event, false)) {
+        wake_multiplexer(shard, false);
+    }
+}
+
+bool IRAM_ATTR state_post_event_from_isr(state_event_t event, BaseType_t* higher_priority_task_woken) {
+    mux_shard_t* shard = get_shard(event);
+
+    STATE_TRACE_RECORD(STATE_TRACE_POST, STATE_TRACE_NO_MACHINE, 0, event);
+
+    if (!ingress_push(shard, event, true)) {
+        return false;
+    }
+
+    if (wake_multiplexer(shard, true) == pdTRUE && higher_priority_task_woken) {
+        *higher_priority_task_woken = pdTRUE;
+    }
+    return true;
+}
+
+void state_post_event_to(state_machine_t machine, state_event_t event) {
+    if (!machine) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    // The shard lock makes us the only producer of the machine's ring
+    mux_shard_t* shard = get_shard(event);
+    STATE_TRACE_RECORD(STATE_TRACE_POST, machine - consumers, 0, event);
+    take_shard(shard);
+    inbox_send(machine, shard, event);
+    if (machine->info->inbox == STATE_INBOX_RING || machine->info->run_on_executor) {
+        inbox_wake(machine);
+    }
+    xSemaphoreGive(shard->lock);
+}
+
+void state_machine_get_lag(state_machine_t machine, state_lag_s* lag) {
+    if (!machine || !lag) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    lag->backlog = 0;
+    for (int lane = 0; lane < STATE_LANES; lane++) {
+        for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+            lag->backlog += state_ring_count(&machine->backlog[lane][i]);
+        }
+    }
+    lag->deferred = __atomic_load_n(&machine->lag_deferred, __ATOMIC_RELAXED);
+    lag->dropped  = __atomic_load_n(&machine->lag_dropped, __ATOMIC_RELAXED);
+}
+
+void state_machine_get_queue_stats(state_machine_t machine, state_queue_stats_s* stats, bool reset) {
+    if (!machine || !stats) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    memset(stats, 0, sizeof(state_queue_stats_s));
+    queue_read(&machine->queue_stats, stats, reset);
+
+    // A notify inbox is one bit per event, nothing to size
+    state_init_s* info = machine->info;
+    if (info->inbox == STATE_INBOX_NOTIFY) {
+        return;
+    }
+
+    stats->depth = machine->inbox_depth;
+    for (int lane = 0; lane < STATE_LANES; lane++) {
+        for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+            stats->used += state_ring_count(&machine->rings[lane][i]) + state_ring_count(&machine->backlog[lane][i]);
+        }
+    }
+    if (info->inbox == STATE_INBOX_QUEUE) {
+        stats->used += uxQueueMessagesWaiting(info->state_queue_input_handle_private);
+    }
+}
+
+void state_core_get_queue_stats(int shard, state_queue_stats_s* stats, bool reset) {
+    if (!stats) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+    if (shard < 0 || shard >= STATE_MUX_SHARDS) {
+        ESP_LOGE(TAG, "No shard %d!", shard);
+        ASSERT(0);
+    }
+
+    memset(stats, 0, sizeof(state_queue_stats_s));
+    queue_read(&shards[shard].queue_stats, stats, reset);
+
+    stats->depth = INCOMING_QUEUE_MAX_DEPTH;
+    for (int lane = 0; lane < STATE_LANES; lane++) {
+        stats->used += state_mpsc_count(&shards[shard].incoming[lane]);
+        if (shards[shard].spill[lane].slots) {
+            stats->used += state_mpsc_count(&shards[shard].spill[lane]);
+        }
+    }
+}
+
+#if STATE_QUEUE_STATS
+// Prints one row of state_core_print_queues()
+static void print_queue(const char* name, const state_queue_stats_s* stats) {
+    uint32_t ms = stats->elapsed_ms ? stats->elapsed_ms : 1;
+
+    printf("%-20s %5u %5u %5u %10u %10u %8u %8u %8u %10u\n", name, (unsigned)stats->depth, (unsigned)stats->used,
+           (unsigned)stats->high_water, (unsigned)stats->enqueued, (unsigned)stats->dequeued,
+           (unsigned)((uint64_t)stats->enqueued * 1000 / ms), (unsigned)((uint64_t)stats->dequeued * 1000 / ms),
+           (unsigned)stats->full, (unsigned)(stats->full_us / 1000));
+}
+#endif
+
+void state_core_print_queues() {
+#if STATE_QUEUE_STATS
+    state_queue_stats_s stats;
+    char                name[24];
+
+    printf("%-20s %5s %5s %5s %10s %10s %8s %8s %8s %10s\n", "queue", "depth", "used", "high", "enqueued",
+           "dequeued", "in/s", "out/s", "full", "full ms");
+    for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+        snprintf(name, sizeof(name), "event_mux %d", i);
+        state_core_get_queue_stats(i, &stats, false);
+        print_queue(name, &stats);
+    }
+
+    // Keeps the machines from going away
+    if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+    for (consumer_mask_t m = registry->live; m; m &= m - 1) {
+        machine_t* machine = &consumers[__builtin_ctzll(m)];
+
+        state_machine_get_queue_stats(machine, &stats, false);
+        print_queue(machine->info->state_name_string, &stats);
+    }
+    xSemaphoreGive(consumer_sem);
+#else
+    printf("STATE_QUEUE_STATS not compiled in, build with STATE_QUEUE_STATS=1\n");
+#endif
+}
+
+void state_core_get_stats(state_machine_t machine, state_stats_s* stats, bool reset) {
+    if (!machine || !stats) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    memset(stats, 0, sizeof(state_stats_s));
+#if STATE_LATENCY
+    // Counting goes on while we read, a reset only takes off what was read
+    for (int leg = 0; leg < state_latency_len; leg++) {
+        state_histogram_s* from = &machine->stats->latency[leg];
+        state_histogram_s* to   = &stats->latency[leg];
+
+        for (int i = 0; i < STATE_LATENCY_BUCKETS; i++) {
+            to->buckets[i] = __atomic_load_n(&from->buckets[i], __ATOMIC_RELAXED);
+            to->count     += to->buckets[i];
+        }
+        if (reset) {
+            for (int i = 0; i < STATE_LATENCY_BUCKETS; i++) {
+                __atomic_fetch_sub(&from->buckets[i], to->buckets[i], __ATOMIC_RELAXED);
+            }
+            to->max_us = __atomic_exchange_n(&from->max_us, 0, __ATOMIC_RELAXED);
+        } else {
+            to->max_us = __atomic_load_n(&from->max_us, __ATOMIC_RELAXED);
+        }
+    }
+#endif
+}
+
+void state_core_get_profile(state_machine_t machine, state_t state, state_profile_s* profile) {
+    if (!machine || !profile) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    memset(profile, 0, sizeof(state_profile_s));
+#if STATE_PROFILE
+    if (machine->profile && state < (state_t)machine->info->total_states) {
+        *profile = machine->profile[state].counters;
+    }
+#endif
+}
+
+size_t state_core_rank_profiles(state_profile_entry_s* entries, size_t max) {
+    size_t total = 0;
+
+    if (!entries) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+#if STATE_PROFILE
+    // Keeps the machines (and their profiles) from going away
+    if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    for (consumer_mask_t m = registry->live; m; m &= m - 1) {
+        machine_t* machine = &consumers[__builtin_ctzll(m)];
+
+        for (state_t state = 0; state < (state_t)machine->info->total_states; state++) {
+            state_profile_entry_s entry = {
+                .machine = machine,
+                .name    = machine->info->state_name_string,
+                .state   = state,
+                .profile = machine->profile[state].counters,
+            };
+            uint64_t cycles = entry.profile.run_cycles + entry.profile.cleanup_cycles;
+            if (!entry.profile.runs && !entry.profile.cleanups) {
+                continue;
+            }
+
+            // Insertion sort, keeping the hottest max
+            size_t i = total < max ? total++ : max;
+            for (; i > 0 && entries[i - 1].profile.run_cycles + entries[i - 1].profile.cleanup_cycles < cycles; i--) {
+                if (i < max) {
+                    entries[i] = entries[i - 1];
+                }
+            }
+            if (i < max) {
+                entries[i] = entry;
+            }
+        }
+    }
+    xSemaphoreGive(consumer_sem);
+#endif
+    return total;
+}
+
+void state_core_print_profiles(size_t top) {
+#if STATE_PROFILE
+    state_profile_entry_s* entries = malloc(top * sizeof(state_profile_entry_s));
+    if (!entries) {
+        ESP_LOGE(TAG, "No memory for %u profiles!", (unsigned)top);
+        return;
+    }
+
+    size_t total = state_core_rank_profiles(entries, top);
+    printf("%-20s %5s %8s %8s %8s %10s %10s %12s %10s %10s %10s\n", "machine", "state", "entries", "loops",
+           "runs", "run avg", "run max", "cycles", "clean avg", "clean max", "dwell ms");
+    for (size_t i = 0; i < total; i++) {
+        state_profile_s* p = &entries[i].profile;
+        printf("%-20s %5u %8u %8u %8u %10u %10u %12llu %10u %10u %10llu\n", entries[i].name,
+               (unsigned)entries[i].state, (unsigned)p->entries, (unsigned)p->loops, (unsigned)p->runs,
+               (unsigned)(p->runs ? p->run_cycles / p->runs : 0), (unsigned)p->run_max,
+               (unsigned long long)(p->run_cycles + p->cleanup_cycles),
+               (unsigned)(p->cleanups ? p->cleanup_cycles / p->cleanups : 0), (unsigned)p->cleanup_max,
+               (unsigned long long)(p->dwell_us / 1000));
+    }
+    free(entries);
+#else
+    printf("STATE_PROFILE not compiled in, build with STATE_PROFILE=1\n");
+#endif
+}
+
+uint32_t state_machine_coalesced(state_machine_t machine) {
+    if (!machine) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+    return __atomic_load_n(&machine->coalesced, __ATOMIC_RELAXED);
+}
+
+// Routes or enqueues part of a burst that belongs to one shard and lane
+static void post_chunk(mux_shard_t* shard, const state_event_t* events, size_t n) {
+    if (direct_dispatch) {
+        route_events(shard, events, NULL, n);
+        return;
+    }
+
+    int lane = get_lane(events[0]);
+    if (spill_pending(shard, lane) || !state_mpsc_push(&shard->incoming[lane], events, n)) {
+        // Doesn't fit as a whole, one at a time under the overflow policy,
+        // with the multiplexer awake to make room
+        for (size_t i = 0; i < n; i++) {
+            if (ingress_push(shard, events[i], false)) {
+                wake_multiplexer(shard, false);
+            }
+        }
+        return;
+    }
+    QUEUE_PUSHED(&shard->queue_stats, n, state_mpsc_count(&shard->incoming[lane]));
+    wake_multiplexer(shard, false);
+}
+
+void state_post_events(const state_event_t* events, size_t n) {
+    if (!events) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+#if STATE_TRACE
+    for (size_t i = 0; i < n; i++) {
+        STATE_TRACE_RECORD(STATE_TRACE_POST, STATE_TRACE_NO_MACHINE, 0, events[i]);
+    }
+#endif
+
+    bool mixed = false;
+    for (size_t i = 1; i < n; i++) {
+        mixed |= get_lane(events[i]) != get_lane(events[0]);
+    }
+
+    // A single shard takes a single lane burst as one contiguous run,
+    // nothing posted concurrently can land in the middle of it
+    if (STATE_MUX_SHARDS == 1 && !mixed && !direct_dispatch) {
+        post_chunk(&shards[0], events, n);
+        return;
+    }
+
+    // Hand each shard its share of every lane in order, a chunk at a
+    // time, highest lane first
+    for (int lane = STATE_LANES - 1; lane >= 0; lane--) {
+        for (int s = 0; s < STATE_MUX_SHARDS; s++) {
+            state_event_t chunk[STATE_MUX_DRAIN_MAX];
+            size_t        count = 0;
+
+            for (size_t i = 0; i < n; i++) {
+                if (get_shard(events[i]) != &shards[s] || get_lane(events[i]) != lane) {
+                    continue;
+                }
+                chunk[count++] = events[i];
+                if (count == STATE_MUX_DRAIN_MAX) {
+                    post_chunk(&shards[s], chunk, count);
+                    count = 0;
+                }
+            }
+            if (count) {
+                post_chunk(&shards[s], chunk, count);
+            }
+        }
+    }
+}
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <errno.h>
+// Counts one call of a state or cleanup function that took cycles
+static inline void profile_call(uint32_t* calls, uint32_t* max, uint64_t* total, uint32_t cycles) {
+    (*calls)++;
+    *total += cycles;
+    if (cycles > *max) {
+        *max = cycles;
+    }
+}
 
-#include "global_defines.h"
-#include "state_core.h"
+// The machine entered state, as its current state or a parent
+static void profile_enter(machine_t* machine, state_t state) {
+#if STATE_PROFILE
+    profile_t* profile = &machine->profile[state];
 
-/**********************************************************
-*                                        GLOBAL VARIABLES *
-**********************************************************/
+    profile->counters.entries++;
+    profile->entered_us = esp_timer_get_time();
+#endif
+}
 
-/**********************************************************
-*                                                TYPEDEFS *
-**********************************************************/
-typedef struct node {
-    struct node*  next;
-    state_init_s* thread_info;
-} node_t;
+// The machine left state
+static void profile_leave(machine_t* machine, state_t state) {
+#if STATE_PROFILE
+    profile_t* profile = &machine->profile[state];
+    uint32_t   stay    = esp_timer_get_time() - profile->entered_us;
 
-/**********************************************************
-*                                        STATIC VARIABLES *
-**********************************************************/
-static const char        TAG[] = "STATE_CORE";
-static QueueSetHandle_t  incoming_events_q;
-static node_t*           head;
-static SemaphoreHandle_t consumer_sem;
+    profile->counters.dwell_us += stay;
+    if (stay > profile->counters.dwell_max_us) {
+        profile->counters.dwell_max_us = stay;
+    }
+#endif
+}
 
-/**********************************************************
-*                                               FUNCTIONS *
-**********************************************************/
+// Runs the function of a state, if it has one. Returns the state it forces,
+// NULL_STATE if none
+static state_t call_state_function(machine_t* machine, state_t state) {
+    func_ptr function = machine->info->translation_table[state].state_function_pointer;
+    state_t  forced   = NULL_STATE;
 
-void add_event_consumer(state_init_s* thread_info) {
-    ESP_LOGI(TAG, "Adding new state machine, name = %s", thread_info->state_name_string);
+    if (function) {
+        STATE_TRACE_RECORD(STATE_TRACE_STATE_BEGIN, machine - consumers, state, 0);
+#if STATE_PROFILE
+        uint32_t start = esp_cpu_get_ccount();
+        forced = function();
+        state_profile_s* counters = &machine->profile[state].counters;
+        profile_call(&counters->runs, &counters->run_max, &counters->run_cycles, esp_cpu_get_ccount() - start);
+#else
+        forced = function();
+#endif
+        STATE_TRACE_RECORD(STATE_TRACE_STATE_END, machine - consumers, state, 0);
+    }
+    return forced;
+}
 
-    if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
-        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
-        ASSERT(0);
+// Runs the cleanup function of a state, if it has one
+static void call_cleanup(machine_t* machine, state_t state) {
+    cleanup_ptr cleanup = machine->info->translation_table[state].state_function_cleanup;
+
+    if (cleanup) {
+        STATE_TRACE_RECORD(STATE_TRACE_CLEANUP_BEGIN, machine - consumers, state, 0);
+#if STATE_PROFILE
+        uint32_t start = esp_cpu_get_ccount();
+        cleanup();
+        state_profile_s* counters = &machine->profile[state].counters;
+        profile_call(&counters->cleanups, &counters->cleanup_max, &counters->cleanup_cycles, esp_cpu_get_ccount() - start);
+#else
+        cleanup();
+#endif
+        STATE_TRACE_RECORD(STATE_TRACE_CLEANUP_END, machine - consumers, state, 0);
     }
+}
 
-    if (head == NULL) {
-        head = malloc(sizeof(node_t));
-        ASSERT(head);
+// Runs the cleanup functions on the way from one state to another, and the
+// state functions of the parents being entered. Must be called after
+// machine->state was set to the new state. from is NULL_STATE on startup
+static void change_state(machine_t* machine, state_t from, state_t to) {
+    state_init_s* info      = machine->info;
+    hierarchy_t*  hierarchy = machine->hierarchy;
 
-        head->next        = NULL;
-        head->thread_info = thread_info;
+    // Bounds check
+    get_state_table(info, to);
+    machine->state_ran = false;
 
-        xSemaphoreGive(consumer_sem);
+    if (!hierarchy) {
+        // Flat machine, only leaves the old state
+        if (from != NULL_STATE) {
+            call_cleanup(machine, from);
+            profile_leave(machine, from);
+        }
+        profile_enter(machine, to);
         return;
     }
 
-    node_t* iter = head;
-    node_t* new  = NULL;
-    while (iter->next != NULL) {
-        iter = iter->next;
+    // Find the closest state both share, walking up from the deeper one
+    state_t a = from;
+    state_t b = to;
+    while (a != NULL_STATE && hierarchy->depths[a] > hierarchy->depths[b]) {
+        a = hierarchy->parents[a];
+    }
+    while (a == NULL_STATE ? b != NULL_STATE : hierarchy->depths[b] > hierarchy->depths[a]) {
+        b = hierarchy->parents[b];
     }
-    new = malloc(sizeof(node_t));
-    ASSERT(new);
+    while (a != b) {
+        a = hierarchy->parents[a];
+        b = hierarchy->parents[b];
+    }
+    state_t common = a;
 
-    iter->next       = new;
-    new->thread_info = thread_info;
-    new->next        = NULL;
-    xSemaphoreGive(consumer_sem);
-}
+    // Leave, innermost first
+    for (state_t s = from; s != common; s = hierarchy->parents[s]) {
+        call_cleanup(machine, s);
+        profile_leave(machine, s);
+    }
 
-// Returns the state function, given a state
-static state_array_s get_state_table(state_init_s * state_ptr, state_t state) {
-    
-    if (state >= state_ptr->total_states) {
-        ESP_LOGE(TAG, "Current state (%d) out of bounds in %s", state, state_ptr->state_name_string);
-        ASSERT(0);
+    // Enter the parents of the new state, outermost first
+    state_t entering[STATE_MAX_DEPTH];
+    int     total = 0;
+    for (state_t s = to == common ? common : hierarchy->parents[to]; s != common; s = hierarchy->parents[s]) {
+        entering[total++] = s;
+    }
+    while (total--) {
+        profile_enter(machine, entering[total]);
+        call_state_function(machine, entering[total]);
+    }
+    if (to != common) {
+        profile_enter(machine, to);
     }
-    return state_ptr->translation_table[state];
 }
 
+// Runs the function of the current state, and its cleanup if it forced
+// a new state. Returns true if it forced a new state
+static bool run_state(machine_t* machine) {
+    // Enter the parents of the starting state
+    if (!machine->started) {
+        machine->started = true;
+        change_state(machine, NULL_STATE, machine->state);
+    }
 
-// used to read from events sent to this state machine
-static state_event_t get_event_generic(QueueHandle_t q_handle, uint32_t timeout) {
-    if (!q_handle){
-      ESP_LOGE(TAG, "NULL HANDLE!");
-      ASSERT(0);
+    // Get the current state information
+    machine->state_info = get_state_table(machine->info, machine->state);
+
+#if STATE_PROFILE
+    // Ran before without leaving the state, so loop_timer ran out
+    if (machine->state_ran) {
+        machine->profile[machine->state].counters.loops++;
     }
-    state_event_t new_event = INVALID_EVENT;
-    xQueueReceive(q_handle, &new_event, timeout);
-    return new_event;
+    machine->state_ran = true;
+#endif
+
+    // Run the current state (parents in a hierarchy may have none)
+    uint32_t start        = esp_cpu_get_ccount();
+    state_t  forced_state = call_state_function(machine, machine->state);
+    machine->load_cycles += esp_cpu_get_ccount() - start;
+
+    if (forced_state == NULL_STATE){
+      return false;
+    }
+
+    // Previous state is forcing next state, don't read from queue
+    STATE_LOGI(STATE_LOG_FORCED, machine->info->state_name_string, forced_state, 0);
+    STATE_TRACE_RECORD(STATE_TRACE_FORCED, machine - consumers, forced_state, 0);
+    state_t prev_state = machine->state;
+    machine->state = forced_state;
+
+    // do cleanup function
+    change_state(machine, prev_state, forced_state);
+    return true;
 }
 
-static void send_event_generic(QueueHandle_t q_handle, state_event_t event, char * name) {
-    if (!q_handle){
-      ESP_LOGE(TAG, "NULL HANDLE!");
-      ASSERT(0);
+// Looks an event up in the transition table, and runs the action of the
+// row that takes it. Returns its next state, STATE_UNHANDLED if no row did
+static state_t find_transition(machine_t* machine, state_event_t event) {
+    transitions_t* table  = machine->transitions;
+    uint32_t       offset = STATE_EVENT_ID(event) - table->first_event;
+
+    if (offset >= table->span || !table->columns[offset]) {
+        return STATE_UNHANDLED;
     }
 
-    // Should never timeout
-    BaseType_t xStatus = xQueueSendToBack(q_handle, &event, GENERIC_QUEUE_TIMEOUT);
-    if (xStatus != pdTRUE) {
-        ESP_LOGE(TAG, "Failed to send on event queue %s ", name);
-        ASSERT(0);
+    uint16_t row = table->cells[machine->state * table->total_columns + table->columns[offset] - 1];
+    for (; row; row = table->next_rows[row - 1]) {
+        const state_transition_s* transition = &machine->info->transitions[row - 1];
+
+        if (transition->guard && !transition->guard(event)) {
+            continue;
+        }
+        if (transition->action) {
+            transition->action(event);
+        }
+        return transition->next;
     }
+    return STATE_UNHANDLED;
 }
 
-// Reads from a global event queue and sends the event
-// to all state machines that have registered for the event
-static void event_multiplexer(void* v) {
-    ESP_LOGI(TAG, "Starting event event_multiplexer");
-    for (;;) {
-        state_event_t event;
-        BaseType_t    xStatus;
+// Passes an event up from the current state until a handler takes it.
+// Returns the handler's result, STATE_UNHANDLED if nobody did
+static state_t bubble_event(machine_t* machine, state_event_t event) {
+    hierarchy_t* hierarchy = machine->hierarchy;
 
-        xStatus = xQueueReceive(incoming_events_q, (void*)&event, portMAX_DELAY);
-        if (xStatus != pdTRUE) {
-            ESP_LOGE(TAG, "Failed to rx... can't recover..");
-            ASSERT(0);
+    for (event_handler_ptr* handler = &hierarchy->chain[hierarchy->handlers[machine->state]]; *handler; handler++) {
+        state_t next = (*handler)(event);
+        if (next != STATE_UNHANDLED) {
+            return next;
         }
+    }
+    return STATE_UNHANDLED;
+}
 
-        ESP_LOGI(TAG, "RXed an event! %d", event);
+// Hands an event to next_state, and runs the cleanup of the current state
+// if it caused a state change. Returns true if the state changed
+static bool handle_event(machine_t* machine, state_event_t event) {
+    state_t curr_state = machine->state;
 
-        // Iterate through all the registered event consumers, see if they
-        // signed up for an event, and if so, send the event to them
-        if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
-            ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
-            ASSERT(0);
+    STATE_LOGI(STATE_LOG_RECEIVED, machine->info->state_name_string, curr_state, event);
+    STATE_TRACE_RECORD(STATE_TRACE_HANDLE_BEGIN, machine - consumers, curr_state, event);
+#if STATE_LATENCY
+    uint32_t received = STATE_LATENCY_NOW();
+    if (machine->info->inbox != STATE_INBOX_NOTIFY) {
+        latency_record(machine, STATE_LATENCY_INBOX, received - machine->inbox_stamp);
+    }
+#endif
+    uint32_t start = esp_cpu_get_ccount();
+    state_t  next  = machine->transitions ? find_transition(machine, event) : STATE_UNHANDLED;
+    if (next == STATE_UNHANDLED && machine->hierarchy) {
+        next = bubble_event(machine, event);
+    }
+    if (next == STATE_UNHANDLED) {
+        if (machine->info->next_state) {
+            machine->info->next_state(&machine->state, event);
         }
+    } else if (next != NULL_STATE) {
+        machine->state = next;
+    }
+    machine->load_cycles += esp_cpu_get_ccount() - start;
 
-        node_t* iter = head;
-        while (iter != NULL) {
-            ESP_LOGI(TAG, "Checking to see if %s is interested in event...", iter->thread_info->state_name_string);
-            if (iter->thread_info->filter_event(event)) {
-                ESP_LOGI(TAG, "sending event %d to %s", event, iter->thread_info->state_name_string);
-                send_event_generic(iter->thread_info->state_queue_input_handle_private, event, iter->thread_info->state_name_string);
+    // This machine is done with the payload
+    state_payload_release(STATE_EVENT_PAYLOAD(event));
+
+    // check to see if there was a state change
+    // only run the state machine in that case
+    bool changed = curr_state != machine->state;
+    if (changed) {
+        change_state(machine, curr_state, machine->state);
+    }
+
+    STATE_TRACE_RECORD(STATE_TRACE_HANDLE_END, machine - consumers, machine->state, event);
+#if STATE_LATENCY
+    latency_record(machine, STATE_LATENCY_HANDLE, STATE_LATENCY_NOW() - received);
+#endif
+    return changed;
+}
+
+static void state_machine(void* arg);
+
+// Runs the cleanup functions of the current state and its parents,
+// innermost first, as the machine goes away
+static void leave_machine(machine_t* machine) {
+    if (!machine->started) {
+        return;
+    }
+
+    for (state_t s = machine->state; s != NULL_STATE; s = machine->hierarchy ? machine->hierarchy->parents[s] : NULL_STATE) {
+        call_cleanup(machine, s);
+        profile_leave(machine, s);
+    }
+}
+
+// Hands back the payloads of the events still in a machine's inbox, and
+// frees the inbox
+static void drain_inbox(machine_t* machine) {
+    QueueHandle_t queue = machine->info->state_queue_input_handle_private;
+    state_event_t event;
+
+    if (queue) {
+        queue_item_t item;
+        while (xQueueReceive(queue, &item, RTOS_DONT_WAIT) == pdTRUE) {
+            if (item.event != STATE_EVENT_WAKE) {
+                state_payload_release(STATE_EVENT_PAYLOAD(item.event));
             }
-            iter = iter->next;
         }
-        xSemaphoreGive(consumer_sem);
+        vQueueDelete(queue);
+
+        // The init struct can be used to start the machine again
+        machine->info->state_queue_input_handle_private = NULL;
+    }
+
+    for (int lane = 0; lane < STATE_LANES; lane++) {
+        for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+            while (state_ring_pop(&machine->rings[lane][i], &event) || state_ring_pop(&machine->backlog[lane][i], &event)) {
+                state_payload_release(STATE_EVENT_PAYLOAD(event));
+            }
+            state_ring_free(&machine->rings[lane][i]);
+            state_ring_free(&machine->backlog[lane][i]);
+        }
     }
 }
 
-static void state_core_init_freertos_objects() {
-    //Reads and Pushes events from state-machines
-    incoming_events_q = xQueueCreate(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t)); // state-machines -> state-core
-    consumer_sem      = xSemaphoreCreateMutex();
+// Takes a stopping machine out for good. Called by whoever runs it (its
+// task, or the executor), after the last state function returned
+static void retire_machine(machine_t* machine) {
+    int            index = machine - consumers;
+    hierarchy_t*   hierarchy   = machine->hierarchy;
+    transitions_t* transitions = machine->transitions;
 
-    // make sure nothing is NULL!
-    ASSERT(incoming_events_q);
-    ASSERT(consumer_sem);
+    ESP_LOGI(TAG, "Stopping state machine %s", machine->info->state_name_string);
+    leave_machine(machine);
+
+    // No more expiries on the way
+    state_timer_stop_all(machine);
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    // Once no router holds a registry with the machine, and nobody is in
+    // the middle of a delivery, nothing can reach the inbox anymore
+    registry_publish(build_registry(registry->live & ~((consumer_mask_t)1 << index)));
+    take_all_shards();
+    give_all_shards();
+
+    drain_inbox(machine);
+    if (hierarchy) {
+        free(hierarchy->parents);
+        free(hierarchy->depths);
+        free(hierarchy->handlers);
+        free(hierarchy->chain);
+        free(hierarchy);
+    }
+    if (transitions) {
+        free(transitions->columns);
+        free(transitions->cells);
+        free(transitions->next_rows);
+        free(transitions);
+    }
+    free(machine->coalesce);
+    free(machine->stats);
+    free(machine->profile);
+
+    // The slot is free for the next machine
+    volatile bool* done = machine->stop_done;
+    memset(machine, 0, sizeof(machine_t));
+    xSemaphoreGive(consumer_sem);
+
+    if (done) {
+        *done = true;
+    }
 }
 
-void state_post_event(state_event_t event) {
-    BaseType_t xStatus = xQueueSendToBack(incoming_events_q, (void*)&event, RTOS_DONT_WAIT);
-    if (xStatus != pdTRUE) {
-        ESP_LOGE(TAG, "Failed to enqueue to event event_multiplexer!");
+// Creates the task of a state machine, pinned to machine->core
+static void create_machine_task(machine_t* machine) {
+    state_placement_s* placement = &machine->info->placement;
+
+    BaseType_t rc = xTaskCreatePinnedToCore(state_machine,
+                                            machine->info->state_name_string,
+                                            placement->stack_depth ? placement->stack_depth : STATE_MACHINE_STACK_DEPTH,
+                                            (void*)machine,
+                                            placement->priority ? placement->priority : STATE_MACHINE_PRIORITY,
+                                            &machine->task,
+                                            machine->core);
+    if (rc != pdPASS) {
         ASSERT(0);
     }
 }
@@ -166,69 +2146,264 @@ static void state_machine(void* arg) {
         ASSERT(0);
     }
 
-    state_init_s* state_init_ptr = (state_init_s*)(arg);
-    state_t       state          = state_init_ptr->starting_state;
-    state_t       forced_state   = NULL_STATE;
+    machine_t*    machine = (machine_t*)(arg);
     state_event_t new_event;
     
     for (;;) {
-        // Get the current state information
-        state_array_s state_info = get_state_table(state_init_ptr, state);
-        func_ptr      state_func = state_info.state_function_pointer;
-        cleanup_ptr   clean_func = state_info.state_function_cleanup;
-
-        // Run the current state
-        forced_state = state_func();
-
-        if (forced_state != NULL_STATE){
-          // Previous state is forcing next state, don't read from queue
-          ESP_LOGI(TAG, "State %s is forcing next state (%d)", state_init_ptr->state_name_string, forced_state );
-          state = forced_state;
-
-          // do cleanup function
-          if(clean_func){
-            clean_func();
-          }
+        if (machine->stopping) {
+            retire_machine(machine);
+            vTaskDelete(NULL);
+        }
+
+        // A task that was moved to another core picks up where
+        // the old task was, waiting for events
+        if (!machine->waiting && run_state(machine)) {
           continue;
         }
-        
-        state_t curr_state = state;
+        machine->waiting = true;
+
         for(;;){
+          // Rebalanced, continue on a new task on the new core. The queue
+          // and the state are in machine, so nothing is lost in the move
+          if (machine->target_core != machine->core) {
+            ESP_LOGI(TAG, "Moving %s to core %d", machine->info->state_name_string, machine->target_core);
+
+            // Routing wakes up machine->task, so swap it while nobody routes
+            take_all_shards();
+            machine->core = machine->target_core;
+            create_machine_task(machine);
+
+            // Event flags live in the task, hand the pending ones over
+            uint32_t bits = 0;
+            if (machine->info->inbox == STATE_INBOX_NOTIFY &&
+                xTaskNotifyWait(0, UINT32_MAX, &bits, RTOS_DONT_WAIT) == pdTRUE && bits) {
+              xTaskNotify(machine->task, bits, eSetBits);
+            }
+            give_all_shards();
+            vTaskDelete(NULL);
+          }
+
           // Wait until a new event comes
-          new_event = get_event_generic(state_init_ptr->state_queue_input_handle_private, state_info.loop_timer);
+          new_event = inbox_receive(machine, machine->state_info.loop_timer);
+
+          // Stopped, whatever we got goes with the rest of the inbox
+          if (machine->stopping) {
+            if (new_event != INVALID_EVENT) {
+              state_payload_release(STATE_EVENT_PAYLOAD(new_event));
+            }
+            retire_machine(machine);
+            vTaskDelete(NULL);
+          }
 
           // Recieved an event, see if we need to change state
           // Don't run if we had a timeout (looping)
-          if (new_event != INVALID_EVENT){
-            ESP_LOGI(TAG, "(%s) In state %d, got event %d", state_init_ptr->state_name_string, state, new_event );
-            state_init_ptr->next_state(&state, new_event);
-          } else {
+          if (new_event == INVALID_EVENT){
             // loop
             break; 
           }
           
-          // check to see if there was a state change
-          // only run the state machine in that case
-          if (curr_state != state){
-            if(clean_func){
-              clean_func();
-            }
+          if (handle_event(machine, new_event)){
             break;
           }
         }
+        machine->waiting = false;
+    }
+}
+
+// Executor version of the state_machine() loop body, for one machine. Runs
+// at most one state function and never blocks. Returns how many ticks until
+// the machine has to run again (portMAX_DELAY if only an event will do)
+static TickType_t executor_step(machine_t* machine, TickType_t now) {
+    state_event_t new_event;
+
+    if (!machine->waiting) {
+        if (run_state(machine)) {
+            // Run the forced state on the next pass, so other machines get a turn
+            return 0;
+        }
+        machine->waiting   = true;
+        machine->wake_tick = now + machine->state_info.loop_timer;
+    }
+
+    for (int handled = 0; (new_event = inbox_receive(machine, RTOS_DONT_WAIT)) != INVALID_EVENT; ) {
+        if (handle_event(machine, new_event)) {
+            machine->waiting = false;
+            return 0;
+        }
+
+        // Same as the task loop, an event without a state change restarts the loop timer
+        machine->wake_tick = now + machine->state_info.loop_timer;
+
+        // A busy producer can't keep us here, the rest waits for the next pass
+        if (++handled == STATE_EXECUTOR_BATCH) {
+            return 0;
+        }
+    }
+
+    if (machine->state_info.loop_timer == portMAX_DELAY) {
+        return portMAX_DELAY;
+    }
+
+    TickType_t remaining = machine->wake_tick - now;
+    if ((int32_t)remaining <= 0) {
+        // loop
+        machine->waiting = false;
+        return 0;
+    }
+    return remaining;
+}
+
+// Runs all the hosted machines to completion, one step each per pass, then
+// sleeps until the router notifies us of new events or a loop timer expires.
+// Hosted machines that are stopping are retired here, between steps
+static void executor(void* v) {
+    ESP_LOGI(TAG, "Starting state executor");
+    for (;;) {
+        TickType_t      now  = xTaskGetTickCount();
+        TickType_t      wait = portMAX_DELAY;
+        registry_t*     current;
+        uint32_t        epoch = registry_enter(&current);
+        consumer_mask_t hosted = current->executor;
+        registry_exit(epoch);
+
+        // Only we retire hosted machines, so their slots stay valid
+        while (hosted) {
+            machine_t* machine = &consumers[__builtin_ctzll(hosted)];
+            hosted &= hosted - 1;
+
+            if (machine->stopping) {
+                retire_machine(machine);
+                continue;
+            }
+
+            TickType_t next = executor_step(machine, now);
+            if (next < wait) {
+                wait = next;
+            }
+        }
+
+        ulTaskNotifyTake(pdTRUE, wait);
+    }
+}
+
+// Adds up, per core, the load of the pinned machines since the last
+// rebalance, and how many there are. Machines with STATE_PLACE_AUTO are
+// skipped if skip_auto is set. Must hold consumer_sem
+static void get_core_loads(uint32_t loads[portNUM_PROCESSORS], int counts[portNUM_PROCESSORS], bool skip_auto) {
+    memset(loads, 0, sizeof(uint32_t) * portNUM_PROCESSORS);
+    memset(counts, 0, sizeof(int) * portNUM_PROCESSORS);
+
+    for (consumer_mask_t m = registry->live; m; m &= m - 1) {
+        machine_t* machine = &consumers[__builtin_ctzll(m)];
+        if (!machine->task || machine->core == tskNO_AFFINITY) {
+            continue;
+        }
+        if (skip_auto && machine->info->placement.core == STATE_PLACE_AUTO) {
+            continue;
+        }
+        loads[machine->target_core] += machine->load_cycles - machine->load_mark;
+        counts[machine->target_core]++;
+    }
+}
+
+// Returns the core with the least load, or with the fewest machines on a tie
+static BaseType_t least_loaded_core(const uint32_t loads[portNUM_PROCESSORS], const int counts[portNUM_PROCESSORS]) {
+    BaseType_t core = 0;
+    for (BaseType_t i = 1; i < portNUM_PROCESSORS; i++) {
+        if (loads[i] < loads[core] || (loads[i] == loads[core] && counts[i] < counts[core])) {
+            core = i;
+        }
+    }
+    return core;
+}
+
+void state_core_rebalance() {
+    uint32_t   loads[portNUM_PROCESSORS];
+    int        counts[portNUM_PROCESSORS];
+    machine_t* movable[STATE_MAX_MACHINES];
+    int        total_movable = 0;
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+        ASSERT(0);
+    }
+
+    // Load that can't move
+    get_core_loads(loads, counts, true);
+
+    // Busiest auto placed machines first (insertion sort, there are few)
+    for (consumer_mask_t m = registry->live; m; m &= m - 1) {
+        machine_t* machine = &consumers[__builtin_ctzll(m)];
+        if (!machine->task || machine->info->placement.core != STATE_PLACE_AUTO) {
+            continue;
+        }
+
+        uint32_t load = machine->load_cycles - machine->load_mark;
+        int      j    = total_movable++;
+        while (j > 0 && (movable[j - 1]->load_cycles - movable[j - 1]->load_mark) < load) {
+            movable[j] = movable[j - 1];
+            j--;
+        }
+        movable[j] = machine;
+    }
+
+    // Each goes to whichever core is least loaded so far
+    for (int i = 0; i < total_movable; i++) {
+        BaseType_t core = least_loaded_core(loads, counts);
+        loads[core] += movable[i]->load_cycles - movable[i]->load_mark;
+        counts[core]++;
+        movable[i]->target_core = core;
+    }
+
+    // Start a new measurement window
+    for (consumer_mask_t m = registry->live; m; m &= m - 1) {
+        consumers[__builtin_ctzll(m)].load_mark = consumers[__builtin_ctzll(m)].load_cycles;
     }
+    xSemaphoreGive(consumer_sem);
 }
 
+// Works out which core a new machine's task goes on
+static BaseType_t get_placement_core(state_placement_s* placement) {
+    switch (placement->core) {
+    case STATE_PLACE_ANY_CORE:
+        return tskNO_AFFINITY;
+
+    case STATE_PLACE_CORE_0:
+    case STATE_PLACE_CORE_1:
+        if (placement->core - STATE_PLACE_CORE_0 >= portNUM_PROCESSORS) {
+            ESP_LOGE(TAG, "Core %d does not exist!", placement->core - STATE_PLACE_CORE_0);
+            ASSERT(0);
+        }
+        return placement->core - STATE_PLACE_CORE_0;
+
+    case STATE_PLACE_AUTO: {
+        uint32_t loads[portNUM_PROCESSORS];
+        int      counts[portNUM_PROCESSORS];
+        if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
+            ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
+            ASSERT(0);
+        }
+        get_core_loads(loads, counts, false);
+        xSemaphoreGive(consumer_sem);
+        return least_loaded_core(loads, counts);
+    }
+
+    default:
+        ESP_LOGE(TAG, "Invalid placement %d!", placement->core);
+        ASSERT(0);
+    }
+    return tskNO_AFFINITY;
+}
 
-void start_new_state_machine(state_init_s* state_ptr) {
+state_machine_t start_new_state_machine(state_init_s* state_ptr) {
     if (!state_ptr) {
         ESP_LOGE(TAG, "ARG==NULL!");
         ASSERT(0);
     }
 
     // Sanity check(s)
-    if (state_ptr->event_print == NULL || state_ptr->next_state == NULL) {
-        ESP_LOGE(TAG, "ERROR! event_print / next_state func was NULL!");
+    if (state_ptr->event_print == NULL) {
+        ESP_LOGE(TAG, "ERROR! event_print func was NULL!");
         ASSERT(0);
     }
 
@@ -248,40 +2423,152 @@ void start_new_state_machine(state_init_s* state_ptr) {
        ESP_LOGE(TAG, "Total states len == 0!");
        ASSERT(0);
     }
+
+    if (state_ptr->total_transitions && state_ptr->transitions == NULL) {
+       ESP_LOGE(TAG, "transitions was NULL!");
+       ASSERT(0);
+    }
+
+    // Someone has to handle the events, next_state, a transition table or the states themselves
+    if (state_ptr->next_state == NULL) {
+        bool handlers = state_ptr->total_transitions != 0;
+        for (int i = 0; i < state_ptr->total_states; i++) {
+            handlers |= state_ptr->translation_table[i].state_function_event != NULL;
+        }
+        if (!handlers) {
+            ESP_LOGE(TAG, "ERROR! next_state func was NULL in %s!", state_ptr->state_name_string);
+            ASSERT(0);
+        }
+    }
+
+    // Needs some way to receive events
+    if(state_ptr->filter_event == NULL && state_ptr->total_subscribed_events == 0){
+       ESP_LOGE(TAG, "No subscribed_events / filter_event in %s!", state_ptr->state_name_string);
+       ASSERT(0);
+    }
+
+    if(state_ptr->total_subscribed_events && state_ptr->subscribed_events == NULL){
+       ESP_LOGE(TAG, "subscribed_events was NULL!");
+       ASSERT(0);
+    }
+
+    if(state_ptr->total_coalesced_events && state_ptr->coalesced_events == NULL){
+       ESP_LOGE(TAG, "coalesced_events was NULL!");
+       ASSERT(0);
+    }
+
+    // Rings index with a mask
+    if (state_ptr->inbox_depth & (state_ptr->inbox_depth - 1)) {
+       ESP_LOGE(TAG, "%s: inbox_depth must be a power of two!", state_ptr->state_name_string);
+       ASSERT(0);
+    }
+
+    // Every event needs a bit in its own task's notification value
+    if (state_ptr->inbox == STATE_INBOX_NOTIFY &&
+        (state_ptr->filter_event || state_ptr->run_on_executor || state_ptr->total_subscribed_events > 32)) {
+       ESP_LOGE(TAG, "%s: STATE_INBOX_NOTIFY needs <= 32 subscribed_events, no filter_event, no run_on_executor!", state_ptr->state_name_string);
+       ASSERT(0);
+    }
       
-    state_ptr->state_queue_input_handle_private = xQueueCreate(EVENT_QUEUE_MAX_DEPTH, sizeof(state_event_t)); 
+    // Ring inboxes are set up when the machine is registered
+    if (state_ptr->inbox == STATE_INBOX_QUEUE) {
+        state_ptr->state_queue_input_handle_private = xQueueCreate(get_inbox_depth(state_ptr), sizeof(queue_item_t));
 
-    // make sure we init all the rtos objects
-    ASSERT(state_ptr->state_queue_input_handle_private);
+        // make sure we init all the rtos objects
+        ASSERT(state_ptr->state_queue_input_handle_private);
+    }
 
     // Register new state machine with event multiplexer
-    add_event_consumer(state_ptr);
+    machine_t* machine = add_event_consumer(state_ptr);
+
+    // Hosted machines are already running on the executor
+    if (state_ptr->run_on_executor) {
+        ESP_LOGI(TAG, "Started new state %s on the executor", state_ptr->state_name_string);
+        return machine;
+    }
+
+    machine->core        = get_placement_core(&state_ptr->placement);
+    machine->target_core = machine->core;
 
     ESP_LOGI(TAG, "Starting new state %s", state_ptr->state_name_string);
-    BaseType_t rc = xTaskCreate(state_machine,
-                                state_ptr->state_name_string,
-                                4096,
-                                (void*)state_ptr,
-                                4,
-                                NULL);
+    create_machine_task(machine);
 
-    if (rc != pdPASS) {
+    // Flags routed while the task was being created were kept aside
+    if (state_ptr->inbox == STATE_INBOX_NOTIFY) {
+        take_all_shards();
+        uint32_t bits = __atomic_exchange_n(&machine->notify_bits, 0, __ATOMIC_RELAXED);
+        if (bits) {
+            xTaskNotify(machine->task, bits, eSetBits);
+        }
+        give_all_shards();
+    }
+    return machine;
+}
+
+void stop_state_machine(state_machine_t machine) {
+    if (!machine) {
+        ESP_LOGE(TAG, "ARG==NULL!");
+        ASSERT(0);
+    }
+
+    if (pdTRUE != xSemaphoreTake(consumer_sem, STATE_MUTEX_WAIT)) {
+        ESP_LOGE(TAG, "FAILED TO TAKE consumer_sem!");
         ASSERT(0);
     }
+
+    if (!machine->info || machine->stopping) {
+        ESP_LOGE(TAG, "Stopping a state machine that isn't running!");
+        ASSERT(0);
+    }
+
+    // Whoever runs the machine retires it, we can't wait on ourselves
+    volatile bool done  = false;
+    TaskHandle_t  owner = machine->info->run_on_executor ? executor_task : machine->task;
+    bool          self  = owner == xTaskGetCurrentTaskHandle();
+
+    machine->stop_done = self ? NULL : &done;
+    machine->stopping  = true;
+
+    // Get it out of its wait, the task can't move while the shards are held.
+    // Still under consumer_sem: the owner may see stopping right away, and
+    // retire_machine() clears the slot under it
+    take_all_shards();
+    if (machine->info->run_on_executor || machine->info->inbox == STATE_INBOX_RING) {
+        inbox_wake(machine);
+    } else if (machine->info->inbox == STATE_INBOX_QUEUE) {
+        queue_wake(machine);
+    } else if (machine->task) {
+        xTaskNotify(machine->task, 0, eSetBits);
+    }
+    give_all_shards();
+    xSemaphoreGive(consumer_sem);
+
+    while (!self && !done) {
+        vTaskDelay(1);
+    }
 }
 
 void state_core_spawner() {
     BaseType_t rc;
 
     state_core_init_freertos_objects();
-    rc = xTaskCreate(event_multiplexer,
-                     "event_multiplexer",
-                     4096,
-                     NULL,
-                     4,
-                     NULL);
+    state_log_start();
 
-    if (rc != pdPASS) {
-        ASSERT(0);
+    // One multiplexer per shard, spread over the cores if there is more than one
+    for (int i = 0; i < STATE_MUX_SHARDS; i++) {
+        char name[configMAX_TASK_NAME_LEN];
+        snprintf(name, sizeof(name), "event_mux_%d", i);
+
+        rc = xTaskCreatePinnedToCore(event_multiplexer,
+                                     name,
+                                     STATE_MUX_STACK_DEPTH,
+                                     (void*)&shards[i],
+                                     STATE_MUX_PRIORITY,
+                                     &shards[i].task,
+                                     STATE_MUX_SHARDS > 1 ? i % portNUM_PROCESSORS : STATE_MUX_CORE);
+
+        if (rc != pdPASS) {
+            ASSERT(0);
+        }
     }
 }
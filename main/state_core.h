@@ -6,11 +6,18 @@
 
 #include "stdbool.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*********************************************************
 *                     TYPEDEFS
 **********************************************************/
-typedef uint32_t state_event_t; // Which event
-typedef uint32_t state_t;       // Which state in a state machine
+typedef uint32_t state_event_t;   // Which event (see STATE_EVENT_ID / STATE_EVENT_PAYLOAD)
+typedef uint32_t state_t;         // Which state in a state machine
+typedef uint8_t  state_payload_t; // Handle to a block in the payload pool
+typedef struct state_machine_s* state_machine_t; // Handle to a running state machine
+typedef uint32_t state_delayed_t; // Handle to a pending delayed event (see state_post_event_after)
 
 // Individual state functions in a state machine
 typedef state_t (*func_ptr)(void);
@@ -18,6 +25,11 @@ typedef state_t (*func_ptr)(void);
 // Individual state cleanup functions in a state machine
 typedef void (*cleanup_ptr)(void);
 
+// Individual state event handlers in a hierarchical state machine.
+// Returns the next state, NULL_STATE if the event was handled without a
+// state change, or STATE_UNHANDLED to pass the event on to the parent state
+typedef state_t (*event_handler_ptr)(state_event_t);
+
 // Defines the individual states, and if those states are reinterant,
 // for example, if a state has loop_timer set to 1 tick, after 1 tick
 // of not getting an event, it will run, and so forth.
@@ -31,8 +43,214 @@ typedef struct {
     // clean up function, NULL if not needed
     cleanup_ptr state_function_cleanup;
 
+    // Hierarchical state machines only, leave both at zero for a flat one.
+    //
+    // Parent of this state, STATE_PARENT(parent_state_enum), or
+    // STATE_NO_PARENT for a top level state. A transition runs the cleanup
+    // functions from the old state up to (not including) the closest state
+    // both share, then the state functions of the new state's parents below
+    // it, top down (as entry actions, their return value is ignored), then
+    // the new state as usual. Parents may have a NULL state function.
+    state_t parent;
+
+    // Event handler, NULL to pass every event on to the parent state.
+    // An event goes to the handler of the current state first, then up
+    // through the parents until one handles it, and only then to next_state
+    // (which may be NULL in a machine with event handlers)
+    event_handler_ptr state_function_event;
+
 } state_array_s;
 
+// One row of a declarative transition table: in state, on event, go to
+// next (NULL_STATE to stay), running action on the way. If guard is set,
+// the row only applies when it returns true, otherwise the next row for
+// the same state and event is tried (rows are tried in table order)
+typedef struct {
+    state_t       state;
+    state_event_t event;  // event ID, without payload
+    state_t       next;
+    void (*action)(state_event_t); // optional, runs before the old state's cleanup
+    bool (*guard)(state_event_t);  // optional
+} state_transition_s;
+
+// Which core the task of a state machine is pinned to
+typedef enum {
+    STATE_PLACE_ANY_CORE = 0, // not pinned (default)
+    STATE_PLACE_CORE_0,
+    STATE_PLACE_CORE_1,
+    STATE_PLACE_AUTO,         // pinned to the least loaded core, moved by state_core_rebalance()
+} state_place_e;
+
+// Where and how the task of a state machine runs, zeros mean defaults
+typedef struct {
+    state_place_e core;
+
+    // Task priority, 0 = STATE_MACHINE_PRIORITY
+    UBaseType_t priority;
+
+    // Task stack depth, 0 = STATE_MACHINE_STACK_DEPTH
+    uint32_t stack_depth;
+
+} state_placement_s;
+
+// Priority class of an event, see STATE_EVENT_WITH_PRIO
+typedef enum {
+    STATE_PRIO_NORMAL = 0, // default, what every plain event ID is
+    STATE_PRIO_URGENT,     // faults, shutdown.. overtakes normal events at every hop
+} state_prio_e;
+
+// What posting does when the multiplexer ring of the event's lane is full.
+// A dropped event's payload goes back to the pool
+typedef enum {
+    // Drop the event being posted (default)
+    STATE_OVERFLOW_DROP_NEWEST = 0,
+
+    // Drop the oldest waiting event to make room
+    STATE_OVERFLOW_DROP_OLDEST,
+
+    // Wait up to block_ticks for room, then drop the event being posted.
+    // ISRs never wait, they drop right away
+    STATE_OVERFLOW_BLOCK,
+
+    // An identical event (same ID, priority and payload) that is still
+    // waiting absorbs the new one, otherwise the oldest is dropped
+    STATE_OVERFLOW_COALESCE,
+
+    // Move on to an overflow ring of STATE_SPILL_DEPTH per lane, and drop
+    // the event if that is full too. Events keep their order, nothing is
+    // routed ahead of spilled events
+    STATE_OVERFLOW_SPILL,
+
+    // Stop the device, for debugging. ISRs can't, they drop the event
+    STATE_OVERFLOW_ASSERT,
+} state_overflow_e;
+
+// How far behind a state machine is. Events that don't fit in its full
+// inbox wait in a backlog (STATE_BACKLOG_DEPTH per lane and shard) instead
+// of holding up the multiplexer and every other machine, and are dropped
+// only once that is full too
+typedef struct {
+    uint32_t backlog;  // events in the backlog now, 0 unless the machine is lagging
+    uint32_t deferred; // events that went to the backlog
+    uint32_t dropped;  // events lost with the backlog full
+} state_lag_s;
+
+// Overflow counters of the multiplexer rings, over all shards and lanes
+typedef struct {
+    uint32_t overflows; // posts that found the ring full
+    uint32_t dropped;   // events lost, newest or oldest
+    uint32_t coalesced; // events absorbed by an identical waiting event
+    uint32_t spilled;   // events that went to the overflow ring
+    uint32_t blocked;   // posts that had to wait for room
+} state_overflow_stats_s;
+
+// Occupancy of an event queue, see STATE_QUEUE_STATS. A machine's inbox is
+// its queue and rings (each depth deep), and is full when the one an event
+// goes to is. Divide the counts by elapsed_ms for rates
+typedef struct {
+    uint32_t depth;      // events each queue / ring holds
+    uint32_t used;       // events waiting now (with the backlog for an inbox)
+    uint32_t high_water; // most events in one queue / ring at once
+    uint32_t enqueued;   // events put in, not notify copies folded into a set bit
+    uint32_t dequeued;   // events taken out
+    uint32_t full;       // events that found it full
+    uint32_t full_us;    // time from the first event that didn't fit to the next one taken out, wraps
+    uint32_t elapsed_ms; // since the counters were started or reset
+} state_queue_stats_s;
+
+// Legs of an event's trip from state_post_event() to a machine, see STATE_LATENCY
+typedef enum {
+    STATE_LATENCY_INGRESS = 0, // posted -> taken from the multiplexer ring
+    STATE_LATENCY_DISPATCH,    // taken by the multiplexer -> in the machine's inbox
+    STATE_LATENCY_INBOX,       // in the inbox -> taken by the machine
+    STATE_LATENCY_HANDLE,      // next_state() / transitions, and the state changes it causes
+    state_latency_len          // LEAVE AS LAST!
+} state_latency_e;
+
+// Log2 histogram of times in us: bucket 0 counts 0 us, bucket i
+// [2^(i-1), 2^i) us, and the last one everything above (from 262 ms)
+#define STATE_LATENCY_BUCKETS (20)
+typedef struct {
+    uint32_t buckets[STATE_LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max_us;
+} state_histogram_s;
+
+// Statistics of one state machine, see state_core_get_stats()
+typedef struct {
+    state_histogram_s latency[state_latency_len];
+} state_stats_s;
+
+// Profile of one state of a machine, see STATE_PROFILE. Function times are
+// in CPU cycles
+typedef struct {
+    uint32_t entries;        // times it was entered, as the current state or a parent
+    uint32_t loops;          // state function runs after loop_timer ran out
+    uint32_t runs;           // state function calls
+    uint32_t run_max;
+    uint64_t run_cycles;     // of all state function calls
+    uint32_t cleanups;       // cleanup function calls
+    uint32_t cleanup_max;
+    uint64_t cleanup_cycles;
+    uint32_t dwell_max_us;   // longest stay, entered to left
+    uint64_t dwell_us;       // of all stays that ended
+} state_profile_s;
+
+// One state in a state_core_rank_profiles() ranking
+typedef struct {
+    state_machine_t machine;
+    const char*     name;    // the machine's state_name_string
+    state_t         state;
+    state_profile_s profile;
+} state_profile_entry_s;
+
+// What a trace record is about, and what its state and event mean
+typedef enum {
+    STATE_TRACE_POST = 0,      // event posted (no machine), or posted to a machine
+    STATE_TRACE_ROUTE_BEGIN,   // multiplexer batch, state = shard, event = first event (no machine)
+    STATE_TRACE_ROUTE_END,     // state = shard, event = events in the batch (no machine)
+    STATE_TRACE_ENQUEUE,       // event on its way to the machine's inbox, state = lane
+    STATE_TRACE_DROP,          // event dropped by a full multiplexer ring (no machine), or a full
+                               // machine backlog after its ENQUEUE, state = lane
+    STATE_TRACE_HANDLE_BEGIN,  // machine took event from its inbox, state = current state
+    STATE_TRACE_HANDLE_END,    // done with event, state = state after it (and its cleanups)
+    STATE_TRACE_STATE_BEGIN,   // state function of state starts
+    STATE_TRACE_STATE_END,
+    STATE_TRACE_CLEANUP_BEGIN, // cleanup function of state starts
+    STATE_TRACE_CLEANUP_END,
+    STATE_TRACE_FORCED,        // state function forced the machine into state
+} state_trace_e;
+
+// One trace record, see STATE_TRACE
+typedef struct {
+    uint32_t      sequence; // position in the trace + 1
+    uint32_t      time_us;  // esp_timer_get_time(), wraps after ~71 minutes
+    state_event_t event;
+    uint16_t      state;
+    uint8_t       machine;  // registration slot, STATE_TRACE_NO_MACHINE if none
+    uint8_t       type;     // state_trace_e
+} state_trace_record_s;
+
+// How events are delivered to a state machine
+typedef enum {
+    // FreeRTOS queue (default)
+    STATE_INBOX_QUEUE = 0,
+
+    // Lock-free single producer / single consumer rings (one per multiplexer
+    // shard) with task notification wakeups. Cheaper than a queue, but state
+    // functions must not use the task notification of their own task
+    STATE_INBOX_RING,
+
+    // Event flags in the task notification value, one bit per entry of
+    // subscribed_events (at most 32, no filter_event, not run_on_executor).
+    // No queue at all, but an event that is posted again before the machine
+    // gets to it is only seen once, pending events come out in
+    // subscribed_events order (urgent ones first), and payloads are
+    // dropped. For machines that only care about which events happened,
+    // not how often
+    STATE_INBOX_NOTIFY,
+} state_inbox_e;
+
 // Init function, used to set up a state machine
 typedef struct {
 
@@ -40,6 +258,7 @@ typedef struct {
     // Note that if a state returns a valid state_t, it will force the next
     // state. Otherwise, if a state returns NULL_STATE, a state change will 
     // happen based on input events.
+    // Optional in a hierarchical machine, see state_function_event.
     void (*next_state)(state_t*, state_event_t);
 
     // This must never be set by the user - internal private variable 
@@ -54,8 +273,18 @@ typedef struct {
     // For debug, name of the state
     char* state_name_string;
 
-    // This function filters events so a state machine
-    // can decide what events to react too
+    // Events this state machine reacts to. These are compiled into the
+    // routing index when the machine is registered, so the multiplexer
+    // can find subscribers with a lookup instead of asking every machine.
+    const state_event_t* subscribed_events;
+
+    // Number of entries in subscribed_events
+    int total_subscribed_events;
+
+    // Optional, dynamic fallback for events that are not known up front.
+    // Called by the multiplexer for every event that is not already routed
+    // to this machine through subscribed_events, so keep it cheap (it runs
+    // while the routing index is held, and must not start or stop machines).
     bool (*filter_event)(state_event_t);
 
     // This is a pointer to a state array as such
@@ -66,19 +295,212 @@ typedef struct {
     // }
     // 
     // Translates a state_e item to a state_array_s object
-    state_array_s * translation_table;
+    const state_array_s * translation_table;
 
     // Total number of states
     int total_states;
 
+    // Optional, declarative transitions, compiled into a dense state x event
+    // lookup table when the machine is registered. An event is looked up
+    // here first, and only goes on to the state event handlers / next_state
+    // (which may be NULL) if no row took it. In a hierarchical machine a
+    // state inherits its parents' rows for events it has no rows for. The
+    // events still have to be listed in subscribed_events, and must lie
+    // within STATE_MAX_EVENT_SPAN of each other.
+    const state_transition_s* transitions;
+
+    // Number of entries in transitions
+    int total_transitions;
+
+    // If true, the state machine gets no task of its own, and runs on the
+    // shared executor together with every other hosted machine. State
+    // functions, cleanups and next_state then run to completion one after
+    // the other, so they must never block (vTaskDelay, waiting on queues..)
+    bool run_on_executor;
+
+    // Core, priority and stack depth of the state machine's task
+    // (not used with run_on_executor)
+    state_placement_s placement;
+
+    // How events are delivered to this state machine
+    state_inbox_e inbox;
+
+    // Optional, idempotent events ("data ready", "link changed") of which
+    // at most one copy waits in the inbox: a normal priority copy posted
+    // while another one is still waiting is absorbed by it (which keeps its
+    // place in the inbox, and is counted, see state_machine_coalesced).
+    // Copies carrying a payload are never absorbed, and STATE_INBOX_NOTIFY
+    // coalesces every event anyway
+    const state_event_t* coalesced_events;
+
+    // Number of entries in coalesced_events
+    int total_coalesced_events;
+
+    // Optional, events the inbox holds before they go to the backlog, a
+    // power of two (per lane and shard for the rings). 0 is
+    // EVENT_QUEUE_MAX_DEPTH. Shrink idle machines and grow busy ones by
+    // their high_water, see state_machine_get_queue_stats. Not used with
+    // STATE_INBOX_NOTIFY
+    uint16_t inbox_depth;
+
 } state_init_s;
 
 /**********************************************************
 *                   GLOBAL FUNCTIONS
 **********************************************************/
+// Posts an event to every subscriber. If the multiplexer ring is full the
+// overflow policy decides (see state_core_set_overflow_policy)
 void state_post_event(state_event_t event);
+
+// Same as state_post_event(), but returns false instead of applying the
+// overflow policy when the multiplexer ring is full (the event is not posted)
+bool state_try_post_event(state_event_t event);
+
+// Picks what happens to events posted while the multiplexer is behind, and
+// how long STATE_OVERFLOW_BLOCK waits. Pick it before posting anything.
+// The counters tell how often it happened, reset clears them
+void state_core_set_overflow_policy(state_overflow_e policy, TickType_t block_ticks);
+void state_core_get_overflow_stats(state_overflow_stats_s* stats, bool reset);
+
+// Posts an event that carries a payload block. The caller's reference to the
+// payload is handed over to state-core, every subscriber gets its own
+// reference, and the block goes back to the pool once the last subscriber's
+// next_state() has returned. Subscribers read it with state_event_payload().
+void state_post_event_with_payload(state_event_t event, state_payload_t payload);
+
+// Posts an event from an ISR (or a task). Never blocks, and never routes
+// inline, even with direct dispatch: the event goes into the multiplexer's
+// lock-free ring and the multiplexer gets a deferred wakeup. Returns false
+// if the overflow policy dropped the event (STATE_OVERFLOW_BLOCK drops
+// right away here). If the multiplexer must run, *higher_priority_task_woken
+// is set to pdTRUE (may be NULL), pass it to portYIELD_FROM_ISR() as usual.
+// Placed in IRAM.
+bool state_post_event_from_isr(state_event_t event, BaseType_t* higher_priority_task_woken);
+
+// Posts a burst of events in one go, routed in order (see STATE_MUX_SHARDS
+// and STATE_LANES). With a single shard a burst in one lane is reserved as
+// one contiguous run, so concurrent posts can't interleave with it. A burst
+// that doesn't fit goes in one event at a time, under the overflow policy.
+void state_post_events(const state_event_t* events, size_t n);
+
+// Direct dispatch: state_post_event() routes the event into the subscribers'
+// queues from the posting task, instead of handing it to the multiplexer task.
+// This saves a context switch and a queue copy per event, but the poster now
+// pays for the fan-out (a full subscriber queue never blocks it, see
+// state_lag_s), and must not be an ISR.
+//
+// Ordering: when state_post_event() returns the event is already in every
+// subscriber's queue. Events from one task arrive in the order they were
+// posted within a lane and shard, and concurrent posters are serialized by
+// the shard's routing lock, so all subscribers see the same relative order
+// of the events of one lane and shard. Urgent events still overtake normal
+// ones, and other shards route in parallel. Events still waiting in the
+// multiplexer ring when the mode is switched on can be overtaken, so pick
+// the mode before posting anything.
+void state_core_set_direct_dispatch(bool enable);
 void state_core_spawner();
-void start_new_state_machine(state_init_s* state_ptr);
+state_machine_t start_new_state_machine(state_init_s* state_ptr);
+
+// Stops a running state machine for good: no more events are routed to it,
+// its timers are stopped, the cleanup functions of its current state (and
+// parents) run, events still in its inbox are dropped (payloads released)
+// and its slot, task and inbox are freed. Returns once all of that is done,
+// except when called by the machine itself (or by any hosted machine for a
+// hosted one), then the machine stops as soon as the running function
+// returns. The handle is invalid afterwards, the init struct can be used
+// to start the machine again. Must not be called from filter_event.
+void stop_state_machine(state_machine_t machine);
+
+// Sends an event straight to one machine's inbox, skipping the routing
+// index: the machine gets it whether it subscribed to it or not (with
+// STATE_INBOX_NOTIFY it must still be one of its subscribed_events).
+// A payload reference is handed over to the machine.
+void state_post_event_to(state_machine_t machine, state_event_t event);
+
+// Copies of coalesced_events absorbed by a waiting copy so far
+uint32_t state_machine_coalesced(state_machine_t machine);
+
+// Backlog and lag counters of a machine, see state_lag_s
+void state_machine_get_lag(state_machine_t machine, state_lag_s* lag);
+
+// Occupancy of a machine's inbox, or of the multiplexer rings of a shard
+// (all lanes together), see STATE_QUEUE_STATS. reset clears the counters
+void state_machine_get_queue_stats(state_machine_t machine, state_queue_stats_s* stats, bool reset);
+void state_core_get_queue_stats(int shard, state_queue_stats_s* stats, bool reset);
+
+// Prints the occupancy of the multiplexer rings and every inbox as a
+// table, with rates since the counters were last reset
+void state_core_print_queues();
+
+// Latency histograms of a machine since it started, or since the last
+// reset, see STATE_LATENCY. All zeros if it is not compiled in
+void state_core_get_stats(state_machine_t machine, state_stats_s* stats, bool reset);
+
+// Profile of one state of a machine, see STATE_PROFILE. All zeros if it is
+// not compiled in. Read while the machine runs, so only a snapshot
+void state_core_get_profile(state_machine_t machine, state_t state, state_profile_s* profile);
+
+// The max states of all machines that spent the most cycles in their state
+// and cleanup functions, hottest first. Returns how many were filled in
+size_t state_core_rank_profiles(state_profile_entry_s* entries, size_t max);
+
+// Prints the top hottest states as a table, for the console
+void state_core_print_profiles(size_t top);
+
+// Named timers on a shared timer wheel (state_timer.c). A timer is named by
+// its machine and event, and its expiry is delivered to the machine like
+// state_post_event_to(). Starting a running timer restarts it with the new
+// ticks, periodic timers rearm themselves every ticks. Start and stop are
+// O(1) and may be called from any task. An expiry that is already being
+// delivered can still arrive just after state_timer_stop().
+// state_timer_stop_all() walks the whole pool, and returns only once no
+// expiry of the machine can still be on the way.
+void state_timer_start(state_machine_t machine, state_event_t event, TickType_t ticks, bool periodic);
+bool state_timer_stop(state_machine_t machine, state_event_t event); // false if it wasn't running
+void state_timer_stop_all(state_machine_t machine);
+bool state_timer_active(state_machine_t machine, state_event_t event);
+
+// Delayed events, on the same timer wheel. The event is posted like
+// state_post_event() once ticks have passed (or at tick, a tick already in
+// the past posts on the next tick). Each pending event takes one of the
+// STATE_MAX_TIMERS slots, shared with the machines' timers. With all of them
+// taken the event is dropped (its payload released) and STATE_DELAYED_NONE
+// is returned, the first time with a warning. state_cancel_delayed() returns
+// false if the event was already posted or cancelled, a stale handle never
+// cancels a newer one.
+#define STATE_DELAYED_NONE ((state_delayed_t)0) // Returned when the timer pool is full
+state_delayed_t state_post_event_after(state_event_t event, TickType_t ticks);
+state_delayed_t state_post_event_at(state_event_t event, TickType_t tick);
+bool state_cancel_delayed(state_delayed_t handle);
+
+// Spreads the machines with STATE_PLACE_AUTO over the cores, busiest first,
+// based on the CPU time each machine used since the last call. A machine
+// moves to its new core the next time it waits for an event. Call this
+// periodically (every few seconds) to follow the load.
+void state_core_rebalance();
+
+// Formats the hot path log records that are still waiting (see
+// STATE_LOG_DEFERRED) right away, e.g. before a reset
+void state_log_flush();
+
+// Trace recorder, see STATE_TRACE. Recording runs from boot, it can be
+// paused around the window of interest. state_trace_dump() copies up to max
+// of the newest records, oldest first, and returns how many.
+// state_trace_print() writes the machine names and records to the console,
+// as STATE_TRACE lines for tools/state_trace.py
+void   state_trace_enable(bool enable);
+size_t state_trace_dump(state_trace_record_s* records, size_t max);
+void   state_trace_print();
+
+// Fixed size, reference counted payload pool (state_payload.c).
+// alloc returns STATE_PAYLOAD_NONE if the pool is empty, the new block
+// has one reference, owned by the caller.
+state_payload_t state_payload_alloc();
+void*           state_payload_data(state_payload_t payload);
+void*           state_event_payload(state_event_t event); // NULL if none
+void            state_payload_retain(state_payload_t payload);
+void            state_payload_release(state_payload_t payload); // also from an ISR
+int             state_payload_available();
 
 /**********************************************************
 *                      GLOBALS    
@@ -93,3 +515,131 @@ extern QueueHandle_t events_net_q;
 #define EVENT_QUEUE_MAX_DEPTH (16)
 #define STATE_MUTEX_WAIT      (2500 / portTICK_PERIOD_MS)
 #define NULL_STATE            (0xFFFF)
+#define STATE_UNHANDLED       (0xFFFE) // event_handler_ptr only, let the parent state handle the event
+#define STATE_NO_PARENT       (0)
+#define STATE_PARENT(state)   ((state_t)(state) + 1)
+#define STATE_MAX_DEPTH       (8)   // Max nesting of hierarchical states
+#define STATE_MAX_EVENT_SPAN  (256) // Max highest - lowest event ID in a transition table
+#define STATE_MAX_MACHINES    (64)  // Max state machines registered at once (width of subscriber masks)
+#define STATE_MAX_ROUTES      (128) // Max distinct events in the routing index (per shard)
+#define STATE_MUX_DRAIN_MAX   (32)  // Max events routed per multiplexer wakeup
+#define INCOMING_QUEUE_MAX_DEPTH (64) // Multiplexer ring per lane, holds a couple of bursts (power of two)
+#define STATE_BACKLOG_DEPTH        (64)   // Per lagging machine, lane and shard, events past a full inbox (power of two)
+#define STATE_SPILL_DEPTH          (256)  // STATE_OVERFLOW_SPILL ring per lane (power of two), allocated when picked
+#define STATE_EXECUTOR_STACK_DEPTH (4096) // Shared by every machine with run_on_executor
+#define STATE_EXECUTOR_BATCH       (8)    // Events a hosted machine handles before the next one gets a turn
+#define STATE_MACHINE_STACK_DEPTH  (4096) // Default state machine task stack
+#define STATE_MACHINE_PRIORITY     (4)    // Default state machine task priority
+#define STATE_MUX_STACK_DEPTH      (4096)
+#define STATE_MUX_PRIORITY         (5)    // Above the machines, so bursts get routed promptly
+#define STATE_MUX_CORE             (tskNO_AFFINITY) // Only used with a single shard
+// Timers and delayed events pending at once, over all machines. The pool
+// is static, 36 bytes per timer on the ESP32 (node and name hash bucket),
+// so 64 take about 2.3 KB of DRAM. At most 65535
+#ifndef STATE_MAX_TIMERS
+#define STATE_MAX_TIMERS           (64)
+#endif
+#define STATE_TIMER_STACK_DEPTH    (4096)
+#define STATE_TIMER_PRIORITY       (5)    // Same as the multiplexer, expiries are just more events
+
+// Logging (state_log.c). STATE_LOG_LEVEL is the compiled in log level of
+// state_core (ESP_LOG_NONE .. ESP_LOG_VERBOSE), anything above it costs
+// nothing. With STATE_LOG_DEFERRED, the hot path (events routed, sent,
+// received, forced states, drops) never formats a string: it writes a
+// fixed size record (message ID, name, two ints, tick) into a lock-free
+// ring, and a task below every machine formats the records later. Records
+// that don't fit are dropped and counted in the output. Other messages
+// and errors are logged right away as usual
+#ifndef STATE_LOG_LEVEL
+#define STATE_LOG_LEVEL            ESP_LOG_INFO
+#endif
+#ifndef STATE_LOG_DEFERRED
+#define STATE_LOG_DEFERRED         (1)
+#endif
+#define STATE_LOG_DEPTH            (128)  // Records in the ring (power of two)
+#define STATE_LOG_STACK_DEPTH      (3072)
+#define STATE_LOG_PRIORITY         (1)
+#define STATE_LOG_FLUSH_TICKS      (20 / portTICK_PERIOD_MS)
+
+// Trace recorder (state_trace.c), compiled in with STATE_TRACE 1. Event
+// posts, multiplexer batches, inbox deliveries, handled events, state and
+// cleanup functions and forced states go into a ring of the newest
+// STATE_TRACE_DEPTH records (16 bytes each), stamped in us and tagged with
+// machine, state and event, from any task or ISR without a lock.
+// tools/state_trace.py turns a printed trace into Chrome trace JSON, for
+// chrome://tracing or ui.perfetto.dev
+#ifndef STATE_TRACE
+#define STATE_TRACE                (0)
+#endif
+#define STATE_TRACE_DEPTH          (1024) // Records in the ring (power of two)
+#define STATE_TRACE_NO_MACHINE     (0xFF)
+
+// Event latency histograms, compiled in with STATE_LATENCY 1. Events are
+// stamped when posted and when put in a machine's inbox (4 more bytes per
+// multiplexer ring, inbox ring and queue slot), and every machine gets a
+// histogram per state_latency_e. Costs a few esp_timer_get_time() calls per
+// event, nothing when compiled out. Events posted straight to a machine,
+// dropped or absorbed by coalescing are left out, and so is the inbox
+// wait of a STATE_INBOX_NOTIFY machine (its copies collapse into one bit)
+#ifndef STATE_LATENCY
+#define STATE_LATENCY              (0)
+#endif
+#define STATE_LATENCY_NOW()        ((uint32_t)esp_timer_get_time())
+
+// Event queue occupancy counters, see state_queue_stats_s. A couple of
+// atomic adds per event, compile out with STATE_QUEUE_STATS 0
+#ifndef STATE_QUEUE_STATS
+#define STATE_QUEUE_STATS          (1)
+#endif
+
+// State profiler, compiled in with STATE_PROFILE 1. Counts, per machine
+// and state, entries, loop_timer reruns, calls and cycles of the state and
+// cleanup functions, and how long the machine stayed. Costs a few cycle
+// counter reads per call, and a state_profile_s per state of every machine
+#ifndef STATE_PROFILE
+#define STATE_PROFILE              (0)
+#endif
+
+// Multiplexer shards. Each shard has its own queue, routing index, lock
+// and task (pinned round robin over the cores), and routes the events
+// whose STATE_EVENT_ID % STATE_MUX_SHARDS is its index.
+// Ordering: events from the same poster arrive in the order they were
+// posted as long as they travel in the same lane and shard, so events with
+// the same ID and priority always do. Higher lanes overtake lower ones even
+// with one shard, and with more shards events with different IDs may
+// overtake each other. filter_event may be called from several shards at
+// once.
+#ifndef STATE_MUX_SHARDS
+#define STATE_MUX_SHARDS           (1)
+#endif
+
+// Payloads: the top byte of an event holds an optional payload handle, so
+// events stay 32 bits and fan-out never copies the payload itself.
+// Machines that receive payloads should compare STATE_EVENT_ID(event).
+#define STATE_PAYLOAD_NONE         (0)
+#define STATE_PAYLOAD_BLOCK_SIZE   (64)  // bytes per block
+#define STATE_PAYLOAD_POOL_SIZE    (32)  // blocks, must be < 255
+#define STATE_EVENT_PAYLOAD_SHIFT  (24)
+#define STATE_EVENT_ID_MASK        (0x003FFFFF)
+#define STATE_EVENT_ID(event)      ((event) & STATE_EVENT_ID_MASK)
+#define STATE_EVENT_PAYLOAD(event) ((state_payload_t)((event) >> STATE_EVENT_PAYLOAD_SHIFT))
+
+// Priority lanes: the two bits below the payload hold the event's
+// state_prio_e. The multiplexer queues and every inbox keep one lane per
+// class and always take from the highest lane first, but once higher lanes
+// have taken STATE_LANE_STARVE_MAX events in a row, a waiting normal event
+// goes next, so normal traffic keeps moving under an urgent flood. Works
+// with every post function, e.g.
+//   state_post_event(STATE_EVENT_WITH_PRIO(EVENT_FAULT, STATE_PRIO_URGENT));
+// Ordering only holds within a lane. Machines get the event without the
+// priority bits.
+#define STATE_LANES                (2)  // Priority classes in use, at most 4
+#define STATE_LANE_STARVE_MAX      (8)  // Higher lane events in a row before a normal one
+#define STATE_EVENT_PRIO_SHIFT     (22)
+#define STATE_EVENT_PRIO_MASK      (0x00C00000)
+#define STATE_EVENT_PRIO(event)    ((state_prio_e)(((event) & STATE_EVENT_PRIO_MASK) >> STATE_EVENT_PRIO_SHIFT))
+#define STATE_EVENT_WITH_PRIO(event, prio) ((event) | ((state_event_t)(prio) << STATE_EVENT_PRIO_SHIFT))
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,305 @@
+#pragma once
+
+// Header-only C++ layer over state_core.h. States, events and transitions
+// are declared as constexpr arrays, and the compiler generates the
+// translation table, subscribed_events, event_print and a dense transition
+// table from them, all in rodata. Mistakes (unknown events, states out of
+// range, two transitions for the same state and event..) fail the build
+// instead of hitting an ASSERT at run time.
+//
+//   enum : state_t       { idle, connected, conn_state_len };
+//   enum : state_event_t { EV_UP = EVENT_START_CONN, EV_DOWN };
+//
+//   constexpr state_dsl::state_decl conn_states[] = {
+//       { idle,      state_idle,      portMAX_DELAY },
+//       { connected, state_connected, 250 / portTICK_PERIOD_MS, cleanup_connected },
+//   };
+//   constexpr state_dsl::event_decl conn_events[] = {
+//       { EV_UP,   "EV_UP" },
+//       { EV_DOWN, "EV_DOWN", true }, // coalesced
+//   };
+//   constexpr state_dsl::transition_decl conn_transitions[] = {
+//       { idle,      EV_UP,   connected, on_up },
+//       { connected, EV_DOWN, idle },
+//   };
+//
+//   using conn_machine = state_dsl::machine<conn_states, conn_events, conn_transitions, idle>;
+//   conn_machine::start("conn_state");
+//
+// Dispatch is one lookup from event ID to column and one table index, the
+// generated next_state() never searches. Needs C++17.
+
+#include <array>
+#include <cstddef>
+#include <iterator>
+
+#include "state_core.h"
+
+static_assert(__cplusplus >= 201703L, "state_dsl.hpp needs C++17 (-std=gnu++17)");
+
+namespace state_dsl {
+
+/**********************************************************
+*                                                TYPEDEFS *
+**********************************************************/
+
+// One state, must be listed in state_t order (id == index)
+struct state_decl {
+    state_t     id;
+    func_ptr    function;
+    uint32_t    loop_timer = portMAX_DELAY;
+    cleanup_ptr cleanup    = nullptr;
+};
+
+// One event the machine subscribes to, with its name for event_print.
+// coalesce puts it in coalesced_events
+struct event_decl {
+    state_event_t id;
+    const char*   name;
+    bool          coalesce = false;
+};
+
+// In state from, on event, go to next (NULL_STATE to stay), running
+// action on the way. At most one transition per state and event
+struct transition_decl {
+    state_t       from;
+    state_event_t event;
+    state_t       next;
+    void        (*action)(state_event_t) = nullptr;
+};
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+namespace detail {
+
+template <const auto& Events>
+constexpr state_event_t first_event() {
+    state_event_t first = Events[0].id;
+    for (const event_decl& event : Events) {
+        first = event.id < first ? event.id : first;
+    }
+    return first;
+}
+
+template <const auto& Events>
+constexpr state_event_t last_event() {
+    state_event_t last = Events[0].id;
+    for (const event_decl& event : Events) {
+        last = event.id > last ? event.id : last;
+    }
+    return last;
+}
+
+template <const auto& States>
+constexpr bool states_in_order() {
+    for (size_t i = 0; i < std::size(States); i++) {
+        if (States[i].id != i || States[i].function == nullptr) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <const auto& Events>
+constexpr bool events_unique() {
+    for (size_t i = 0; i < std::size(Events); i++) {
+        for (size_t j = i + 1; j < std::size(Events); j++) {
+            if (Events[i].id == Events[j].id) {
+                return false;
+            }
+        }
+        if (STATE_EVENT_ID(Events[i].id) != Events[i].id) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <const auto& Events>
+constexpr bool is_event(state_event_t id) {
+    for (const event_decl& event : Events) {
+        if (event.id == id) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <const auto& States, const auto& Events, const auto& Transitions>
+constexpr bool transitions_valid() {
+    for (size_t i = 0; i < std::size(Transitions); i++) {
+        const transition_decl& t = Transitions[i];
+        if (t.from >= std::size(States) || (t.next != NULL_STATE && t.next >= std::size(States))) {
+            return false;
+        }
+        if (!is_event<Events>(t.event)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <const auto& Transitions>
+constexpr bool transitions_unique() {
+    for (size_t i = 0; i < std::size(Transitions); i++) {
+        for (size_t j = i + 1; j < std::size(Transitions); j++) {
+            if (Transitions[i].from == Transitions[j].from && Transitions[i].event == Transitions[j].event) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// One (state, event) entry of a generated transition table
+struct cell_t {
+    state_t next = STATE_UNHANDLED; // STATE_UNHANDLED if there is no transition
+    void  (*action)(state_event_t) = nullptr;
+};
+
+template <const auto& States>
+constexpr auto make_translation_table() {
+    std::array<state_array_s, std::size(States)> table{};
+    for (size_t i = 0; i < std::size(States); i++) {
+        table[i].state_function_pointer = States[i].function;
+        table[i].loop_timer             = States[i].loop_timer;
+        table[i].state_function_cleanup = States[i].cleanup;
+    }
+    return table;
+}
+
+template <const auto& Events>
+constexpr auto make_subscribed_events() {
+    std::array<state_event_t, std::size(Events)> events{};
+    for (size_t i = 0; i < std::size(Events); i++) {
+        events[i] = Events[i].id;
+    }
+    return events;
+}
+
+template <const auto& Events>
+constexpr size_t total_coalesced() {
+    size_t total = 0;
+    for (const event_decl& event : Events) {
+        total += event.coalesce;
+    }
+    return total;
+}
+
+template <const auto& Events, size_t Total>
+constexpr auto make_coalesced_events() {
+    std::array<state_event_t, Total> events{};
+    size_t                           total = 0;
+    for (const event_decl& event : Events) {
+        if (event.coalesce) {
+            events[total++] = event.id;
+        }
+    }
+    return events;
+}
+
+// Event ID - First -> index in Events, -1 if not one of the machine's events
+template <const auto& Events, state_event_t First, size_t Span>
+constexpr auto make_columns() {
+    std::array<int16_t, Span> columns{};
+    for (size_t i = 0; i < Span; i++) {
+        columns[i] = -1;
+    }
+    for (size_t i = 0; i < std::size(Events); i++) {
+        columns[Events[i].id - First] = i;
+    }
+    return columns;
+}
+
+template <const auto& States, const auto& Events, const auto& Transitions, state_event_t First, const auto& Columns>
+constexpr auto make_cells() {
+    std::array<std::array<cell_t, std::size(Events)>, std::size(States)> cells{};
+    for (const transition_decl& t : Transitions) {
+        cell_t& cell = cells[t.from][Columns[t.event - First]];
+        cell.next    = t.next;
+        cell.action  = t.action;
+    }
+    return cells;
+}
+
+} // namespace detail
+
+/**********************************************************
+*                                                 MACHINE *
+**********************************************************/
+template <const auto& States, const auto& Events, const auto& Transitions, state_t Start>
+class machine {
+    static constexpr size_t        total_states  = std::size(States);
+    static constexpr size_t        total_events  = std::size(Events);
+    static constexpr state_event_t first_event   = detail::first_event<Events>();
+    static constexpr size_t        span          = detail::last_event<Events>() - first_event + 1;
+
+    static_assert(detail::states_in_order<States>(), "states must be listed in state_t order, each with a state function");
+    static_assert(detail::events_unique<Events>(), "events must be listed once, without a payload or priority");
+    static_assert(span <= STATE_MAX_EVENT_SPAN, "events span too far, increase STATE_MAX_EVENT_SPAN");
+    static_assert(detail::transitions_valid<States, Events, Transitions>(), "transition with an unknown state or event");
+    static_assert(detail::transitions_unique<Transitions>(), "two transitions for the same state and event");
+    static_assert(Start < total_states, "starting state out of range");
+
+    static constexpr auto translation_table = detail::make_translation_table<States>();
+    static constexpr auto subscribed_events = detail::make_subscribed_events<Events>();
+    static constexpr auto coalesced_events  = detail::make_coalesced_events<Events, detail::total_coalesced<Events>()>();
+    static constexpr auto columns           = detail::make_columns<Events, first_event, span>();
+    static constexpr auto cells             = detail::make_cells<States, Events, Transitions, first_event, columns>();
+
+    // Column of an event, -1 if it is not one of ours
+    static int column(state_event_t event) {
+        uint32_t offset = STATE_EVENT_ID(event) - first_event;
+        return offset < span ? columns[offset] : -1;
+    }
+
+    static void next_state(state_t* state, state_event_t event) {
+        int index = column(event);
+        if (index < 0) {
+            return;
+        }
+
+        const detail::cell_t& cell = cells[*state][index];
+        if (cell.next == STATE_UNHANDLED) {
+            return;
+        }
+        if (cell.action) {
+            cell.action(event);
+        }
+        if (cell.next != NULL_STATE) {
+            *state = cell.next;
+        }
+    }
+
+    static char* event_print(state_event_t event) {
+        int index = column(event);
+        return index < 0 ? nullptr : const_cast<char*>(Events[index].name);
+    }
+
+  public:
+    // Returns the generated init struct of the machine (one per machine
+    // type). Options like inbox, placement or run_on_executor can be set
+    // on it before it goes to start_new_state_machine()
+    static state_init_s* init(const char* name) {
+        static state_init_s init_s = {};
+
+        init_s.next_state              = next_state;
+        init_s.event_print             = event_print;
+        init_s.starting_state          = Start;
+        init_s.state_name_string       = const_cast<char*>(name);
+        init_s.subscribed_events       = subscribed_events.data();
+        init_s.total_subscribed_events = total_events;
+        init_s.coalesced_events        = coalesced_events.size() ? coalesced_events.data() : nullptr;
+        init_s.total_coalesced_events  = coalesced_events.size();
+        init_s.translation_table       = translation_table.data();
+        init_s.total_states            = total_states;
+        return &init_s;
+    }
+
+    static void start(const char* name) {
+        start_new_state_machine(init(name));
+    }
+};
+
+} // namespace state_dsl
@@ -0,0 +1,68 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_system.h"
+#include "esp_log.h"
+
+#include "global_defines.h"
+#include "state_dsl.hpp"
+#include "state_dsl_test.h"
+
+/*********************************************************
+*                                       STATIC VARIABLES *
+*********************************************************/
+static const char TAG[] = "TEST_DSL";
+
+enum : state_t { dsl_off, dsl_on, dsl_test_state_len };
+
+/**********************************************************
+*                                         STATE FUNCTIONS *
+**********************************************************/
+
+static state_t state_off() {
+  ESP_LOGI(TAG, "Entering state OFF");
+
+  return NULL_STATE;
+}
+
+// Loops every second until toggled off
+static state_t state_on() {
+  ESP_LOGI(TAG, "In state ON");
+
+  return NULL_STATE;
+}
+
+static void cleanup_on() {
+  ESP_LOGI(TAG, "Leaving state ON");
+}
+
+static void log_toggle(state_event_t) {
+  ESP_LOGI(TAG, "Toggled");
+}
+
+/**********************************************************
+*                                                 MACHINE *
+**********************************************************/
+
+// Listed in state order, see state_dsl.hpp
+constexpr state_dsl::state_decl dsl_states[] = {
+  { dsl_off, state_off, portMAX_DELAY },
+  { dsl_on,  state_on,  1000 / portTICK_PERIOD_MS, cleanup_on },
+};
+
+constexpr state_dsl::event_decl dsl_events[] = {
+  { DSL_TEST_EVENT_TOGGLE, "DSL_TEST_EVENT_TOGGLE" },
+  { DSL_TEST_EVENT_RESET,  "DSL_TEST_EVENT_RESET", true },
+};
+
+constexpr state_dsl::transition_decl dsl_transitions[] = {
+  { dsl_off, DSL_TEST_EVENT_TOGGLE, dsl_on,  log_toggle },
+  { dsl_on,  DSL_TEST_EVENT_TOGGLE, dsl_off, log_toggle },
+  { dsl_on,  DSL_TEST_EVENT_RESET,  dsl_off },
+};
+
+using dsl_test_machine = state_dsl::machine<dsl_states, dsl_events, dsl_transitions, dsl_off>;
+
+void dsl_test_spawner() {
+  dsl_test_machine::start("dsl_test_state");
+}
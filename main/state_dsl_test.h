@@ -0,0 +1,28 @@
+#pragma once
+#include "state_core.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***********************************************************
+ *                                                 GLOBALS *
+ **********************************************************/
+// Starts the example machine built with state_dsl.hpp, mostly so the
+// templates and their static_asserts are compiled with the project
+void dsl_test_spawner();
+
+
+/***********************************************************
+ *                                                   ENUMS *
+ **********************************************************/
+typedef enum {
+  DSL_TEST_EVENT_TOGGLE = EVENT_START_DSL_TEST,
+  DSL_TEST_EVENT_RESET,
+
+  dsl_test_event_len //LEAVE AS LAST!
+} dsl_test_event_e;
+
+#ifdef __cplusplus
+}
+#endif
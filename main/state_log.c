@@ -0,0 +1,191 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_system.h"
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_log.h"
+
+/**********************************************************
+*                                                TYPEDEFS *
+**********************************************************/
+// One slot of the record ring. Its sequence says whose turn it is: the
+// slot is free for the writer of position p when it is p, and holds the
+// record of position p for the reader when it is p + 1
+typedef struct {
+    uint32_t    sequence; // atomic, minus the slot's index, so all zeros is a fresh ring
+    TickType_t  tick;     // when it was logged
+    const char* name;
+    int         args[2];
+    uint8_t     message;  // state_log_e
+    uint8_t     level;
+} log_record_t;
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char    TAG[] = "STATE_CORE";
+
+// Indexed by state_log_e, every format takes the name and two ints
+static const char*   log_formats[state_log_len] = {
+    [STATE_LOG_ROUTED]   = "%s: RXed %d event(s), first %d",
+    [STATE_LOG_SENT]     = "%s: sending event %d",
+    [STATE_LOG_RECEIVED] = "%s: in state %d, got event %d",
+    [STATE_LOG_FORCED]   = "%s: state is forcing next state (%d)",
+    [STATE_LOG_DROPPED]  = "%s is too far behind, dropped event %d",
+};
+
+#if STATE_LOG_DEFERRED
+// Bounded lock-free ring, any number of writers and readers. Positions
+// run freely and wrap, only their difference matters
+static log_record_t  log_ring[STATE_LOG_DEPTH];
+static uint32_t      log_head;    // next position to write, atomic
+static uint32_t      log_tail;    // next position to read, atomic
+static uint32_t      log_dropped; // records that didn't fit, atomic
+static TaskHandle_t  log_task;
+#endif
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+// Formats a record the way ESP_LOGx would have, with the time it was logged
+static void log_print(const log_record_t* record) {
+    static const char letters[] = "NEWIDV";
+    char              line[128];
+
+    snprintf(line, sizeof(line), log_formats[record->message], record->name, record->args[0], record->args[1]);
+    esp_log_write(record->level, TAG, "%c (%u) %s: %s\n",
+                  letters[record->level], (unsigned)(record->tick * portTICK_PERIOD_MS), TAG, line);
+}
+
+#if STATE_LOG_DEFERRED
+static uint32_t get_sequence(log_record_t* slot) {
+    return __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) + (slot - log_ring);
+}
+
+static void set_sequence(log_record_t* slot, uint32_t sequence) {
+    __atomic_store_n(&slot->sequence, sequence - (slot - log_ring), __ATOMIC_RELEASE);
+}
+
+// Takes the oldest record, returns false if there is none
+static bool log_pop(log_record_t* record) {
+    uint32_t pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        log_record_t* slot = &log_ring[pos & (STATE_LOG_DEPTH - 1)];
+        int32_t       diff = (int32_t)(get_sequence(slot) - (pos + 1));
+
+        if (diff < 0) {
+            return false;
+        }
+        if (diff > 0) {
+            // Another reader took it
+            pos = __atomic_load_n(&log_tail, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&log_tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            *record = *slot;
+
+            // Free for the writer one lap later
+            set_sequence(slot, pos + STATE_LOG_DEPTH);
+            return true;
+        }
+    }
+}
+
+// Formats everything logged so far, and how much was lost
+static void log_drain() {
+    log_record_t record;
+
+    while (log_pop(&record)) {
+        log_print(&record);
+    }
+
+    uint32_t dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+        ESP_LOGW(TAG, "%u log records dropped, increase STATE_LOG_DEPTH or lower STATE_LOG_LEVEL", (unsigned)dropped);
+    }
+}
+
+// Formats the records in the background, below every machine
+static void log_service(void* v) {
+    for (;;) {
+        log_drain();
+        vTaskDelay(STATE_LOG_FLUSH_TICKS);
+    }
+}
+#endif
+
+void state_log_write(int level, state_log_e message, const char* name, int a, int b) {
+#if STATE_LOG_DEFERRED
+    uint32_t      pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+    log_record_t* slot;
+
+    // Claim a free slot, never wait for one
+    for (;;) {
+        slot = &log_ring[pos & (STATE_LOG_DEPTH - 1)];
+        int32_t diff = (int32_t)(get_sequence(slot) - pos);
+
+        if (diff < 0) {
+            __atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        if (diff > 0) {
+            // Another writer took it
+            pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+            continue;
+        }
+        if (__atomic_compare_exchange_n(&log_head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    slot->tick    = xTaskGetTickCount();
+    slot->name    = name;
+    slot->args[0] = a;
+    slot->args[1] = b;
+    slot->message = message;
+    slot->level   = level;
+    set_sequence(slot, pos + 1);
+#else
+    log_record_t record = {
+        .tick    = xTaskGetTickCount(),
+        .name    = name,
+        .args    = { a, b },
+        .message = message,
+        .level   = level,
+    };
+    log_print(&record);
+#endif
+}
+
+void state_log_flush() {
+#if STATE_LOG_DEFERRED
+    log_drain();
+#endif
+}
+
+void state_log_start() {
+#if STATE_LOG_DEFERRED
+    if (log_task) {
+        return;
+    }
+
+    BaseType_t rc = xTaskCreate(log_service,
+                                "state_log",
+                                STATE_LOG_STACK_DEPTH,
+                                NULL,
+                                STATE_LOG_PRIORITY,
+                                &log_task);
+    if (rc != pdPASS) {
+        ASSERT(0);
+    }
+#endif
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "esp_log.h"
+
+#include "state_core.h"
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// Hot path messages, a record only stores the ID. Every message is
+// formatted with the record's name, then its two arguments
+typedef enum {
+    STATE_LOG_ROUTED = 0, // multiplexer: events in the batch, first event
+    STATE_LOG_SENT,       // machine: event
+    STATE_LOG_RECEIVED,   // machine: state, event
+    STATE_LOG_FORCED,     // machine: forced state
+    STATE_LOG_DROPPED,    // machine: event
+    state_log_len         // LEAVE AS LAST!
+} state_log_e;
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+
+// Logs a hot path message, see STATE_LOG_DEFERRED. name must outlive the
+// record (machine names, string literals). Use the STATE_LOGx macros, so
+// messages above STATE_LOG_LEVEL are compiled out
+void state_log_write(int level, state_log_e message, const char* name, int a, int b);
+
+// Starts the task that formats deferred records, called by state_core_spawner()
+void state_log_start();
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#define STATE_LOG(level, message, name, a, b)                           \
+    do {                                                                \
+        if ((level) <= STATE_LOG_LEVEL) {                               \
+            state_log_write((level), (message), (name), (a), (b));      \
+        }                                                               \
+    } while (0)
+
+#define STATE_LOGW(message, name, a, b) STATE_LOG(ESP_LOG_WARN, message, name, a, b)
+#define STATE_LOGI(message, name, a, b) STATE_LOG(ESP_LOG_INFO, message, name, a, b)
+#define STATE_LOGD(message, name, a, b) STATE_LOG(ESP_LOG_DEBUG, message, name, a, b)
@@ -0,0 +1,124 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global_defines.h"
+#include "state_core.h"
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static DRAM_ATTR const char TAG[] = "STATE_PAYLOAD"; // in DRAM for ESP_DRAM_LOGE
+static portMUX_TYPE payload_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// The pool itself, a block's handle is its index + 1 (0 is STATE_PAYLOAD_NONE)
+static uint8_t      payload_blocks[STATE_PAYLOAD_POOL_SIZE][STATE_PAYLOAD_BLOCK_SIZE] __attribute__((aligned(4)));
+static uint16_t     payload_refs[STATE_PAYLOAD_POOL_SIZE];
+
+// Stack of free handles, protected by payload_lock
+static uint8_t      payload_free[STATE_PAYLOAD_POOL_SIZE];
+static int          payload_free_top = -1; // -1 = not initialized yet
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+// Stops on a bad handle. Also called from ISRs, where ESP_LOGE can't be
+// used and ASSERT would wait in vTaskDelay
+#define PAYLOAD_FAIL(format, payload)         \
+    do {                                      \
+        ESP_DRAM_LOGE(TAG, format, payload);  \
+        abort();                              \
+    } while (0)
+
+// Returns the block index of a handle
+static int IRAM_ATTR payload_index(state_payload_t payload) {
+    if (payload == STATE_PAYLOAD_NONE || payload > STATE_PAYLOAD_POOL_SIZE) {
+        PAYLOAD_FAIL("Invalid payload handle %d", payload);
+    }
+    return payload - 1;
+}
+
+state_payload_t state_payload_alloc() {
+    state_payload_t payload = STATE_PAYLOAD_NONE;
+
+    portENTER_CRITICAL(&payload_lock);
+    if (payload_free_top < 0) {
+        for (int i = 0; i < STATE_PAYLOAD_POOL_SIZE; i++) {
+            payload_free[i] = STATE_PAYLOAD_POOL_SIZE - i;
+        }
+        payload_free_top = STATE_PAYLOAD_POOL_SIZE;
+    }
+
+    if (payload_free_top > 0) {
+        payload = payload_free[--payload_free_top];
+        payload_refs[payload - 1] = 1;
+    }
+    portEXIT_CRITICAL(&payload_lock);
+
+    if (payload == STATE_PAYLOAD_NONE) {
+        ESP_LOGW(TAG, "Payload pool exhausted!");
+    }
+    return payload;
+}
+
+void* state_payload_data(state_payload_t payload) {
+    if (payload == STATE_PAYLOAD_NONE) {
+        return NULL;
+    }
+    return payload_blocks[payload_index(payload)];
+}
+
+void* state_event_payload(state_event_t event) {
+    return state_payload_data(STATE_EVENT_PAYLOAD(event));
+}
+
+void state_payload_retain(state_payload_t payload) {
+    if (payload == STATE_PAYLOAD_NONE) {
+        return;
+    }
+    int index = payload_index(payload);
+
+    portENTER_CRITICAL(&payload_lock);
+    if (payload_refs[index] == 0) {
+        portEXIT_CRITICAL(&payload_lock);
+        ESP_LOGE(TAG, "Retaining free payload %d!", payload);
+        ASSERT(0);
+    }
+    payload_refs[index]++;
+    portEXIT_CRITICAL(&payload_lock);
+}
+
+// Dropping an event posted from an ISR releases its payload there
+void IRAM_ATTR state_payload_release(state_payload_t payload) {
+    if (payload == STATE_PAYLOAD_NONE) {
+        return;
+    }
+    int index = payload_index(payload);
+
+    portENTER_CRITICAL_SAFE(&payload_lock);
+    if (payload_refs[index] == 0) {
+        portEXIT_CRITICAL_SAFE(&payload_lock);
+        PAYLOAD_FAIL("Releasing free payload %d!", payload);
+    }
+
+    // Last reference, back to the pool
+    if (--payload_refs[index] == 0) {
+        payload_free[payload_free_top++] = payload;
+    }
+    portEXIT_CRITICAL_SAFE(&payload_lock);
+}
+
+int state_payload_available() {
+    portENTER_CRITICAL(&payload_lock);
+    int available = payload_free_top < 0 ? STATE_PAYLOAD_POOL_SIZE : payload_free_top;
+    portEXIT_CRITICAL(&payload_lock);
+    return available;
+}
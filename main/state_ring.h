@@ -0,0 +1,265 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "stdbool.h"
+
+#include "esp_attr.h"
+
+#include "state_core.h"
+
+#if STATE_LATENCY
+#include "esp_timer.h"
+#endif
+
+/*********************************************************
+*                     TYPEDEFS
+**********************************************************/
+
+// Lock-free single producer / single consumer ring of events.
+// Exactly one task (or one lock holder) may push, and exactly one
+// may pop, at a time. Indexes run freely and wrap, only their
+// difference matters, so all capacity slots are usable.
+typedef struct {
+    state_event_t*    buffer;
+#if STATE_LATENCY
+    uint32_t*         stamps; // when each event was pushed
+#endif
+    uint32_t          mask; // capacity - 1, capacity is a power of two
+    volatile uint32_t head; // next slot to write, only the producer moves it
+    volatile uint32_t tail; // next slot to read, only the consumer moves it
+} state_ring_t;
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+
+// Frees what state_ring_init() allocated, nobody may use the ring anymore
+static inline void state_ring_free(state_ring_t* ring) {
+    free(ring->buffer);
+    ring->buffer = NULL;
+#if STATE_LATENCY
+    free(ring->stamps);
+    ring->stamps = NULL;
+#endif
+}
+
+// Allocates the ring, capacity must be a power of two.
+// Returns false if out of memory
+static inline bool state_ring_init(state_ring_t* ring, uint32_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1))) {
+        return false;
+    }
+#if STATE_LATENCY
+    ring->stamps = malloc(capacity * sizeof(uint32_t));
+    if (!ring->stamps) {
+        return false;
+    }
+#endif
+    ring->mask   = capacity - 1;
+    ring->head   = 0;
+    ring->tail   = 0;
+    ring->buffer = malloc(capacity * sizeof(state_event_t));
+    if (!ring->buffer) {
+        state_ring_free(ring);
+        return false;
+    }
+    return true;
+}
+
+// Producer side, returns false if the ring is full
+static inline bool state_ring_push(state_ring_t* ring, state_event_t event) {
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail > ring->mask) {
+        return false;
+    }
+    ring->buffer[head & ring->mask] = event;
+#if STATE_LATENCY
+    ring->stamps[head & ring->mask] = STATE_LATENCY_NOW();
+#endif
+
+    // Publish the slot after it has been written
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Consumer side, returns false if the ring is empty. stamp gets when the
+// event was pushed (STATE_LATENCY_NOW()), 0 without STATE_LATENCY
+static inline bool state_ring_pop_stamped(state_ring_t* ring, state_event_t* event, uint32_t* stamp) {
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        return false;
+    }
+    *event = ring->buffer[tail & ring->mask];
+#if STATE_LATENCY
+    *stamp = ring->stamps[tail & ring->mask];
+#else
+    *stamp = 0;
+#endif
+
+    // Hand the slot back after it has been read
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Consumer side, returns false if the ring is empty
+static inline bool state_ring_pop(state_ring_t* ring, state_event_t* event) {
+    uint32_t stamp;
+    return state_ring_pop_stamped(ring, event, &stamp);
+}
+
+// Number of events in the ring, only a snapshot if the other side is running
+static inline uint32_t state_ring_count(state_ring_t* ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/*********************************************************
+*                 MULTI PRODUCER RING
+**********************************************************/
+
+// One slot of a state_mpsc_ring_t. sequence tells the slot's
+// state for a given position p: p = free, p + 1 = holds the event
+typedef struct {
+    volatile uint32_t sequence;
+    state_event_t     event;
+#if STATE_LATENCY
+    uint32_t          stamp; // when it was pushed
+#endif
+} state_mpsc_slot_t;
+
+// Lock-free, bounded multi producer / single consumer ring of events.
+// Producers (tasks or ISRs, on any core) reserve slots by moving head with
+// a compare and swap, then publish each slot through its sequence number.
+// Slots are taken the same way at the tail, so a producer may also pop, to
+// drop the oldest event when the ring is full. Never blocks, so it is safe
+// to use from an ISR. The functions an ISR calls are in IRAM, -Og doesn't
+// inline them
+typedef struct {
+    state_mpsc_slot_t* slots;
+    uint32_t           mask; // capacity - 1, capacity is a power of two
+    volatile uint32_t  head; // next position to reserve
+    volatile uint32_t  tail; // next position to read
+} state_mpsc_ring_t;
+
+// Allocates the ring, capacity must be a power of two.
+// Returns false if out of memory
+static inline bool state_mpsc_init(state_mpsc_ring_t* ring, uint32_t capacity) {
+    if (capacity == 0 || (capacity & (capacity - 1))) {
+        return false;
+    }
+    ring->slots = malloc(capacity * sizeof(state_mpsc_slot_t));
+    if (!ring->slots) {
+        return false;
+    }
+    for (uint32_t i = 0; i < capacity; i++) {
+        ring->slots[i].sequence = i;
+    }
+    ring->mask = capacity - 1;
+    ring->head = 0;
+    ring->tail = 0;
+    return true;
+}
+
+// Producer side, pushes n events as one contiguous run, or nothing at all
+// if they don't fit. Returns false if the ring is too full
+static inline bool IRAM_ATTR state_mpsc_push(state_mpsc_ring_t* ring, const state_event_t* events, uint32_t n) {
+    uint32_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+#if STATE_LATENCY
+    uint32_t stamp = STATE_LATENCY_NOW();
+#endif
+
+    if (n == 0 || n > ring->mask + 1) {
+        return n == 0;
+    }
+
+    for (;;) {
+        // Every slot of the run has to be free. Producers that drop the
+        // oldest event pop too, so a later slot can be freed while an
+        // earlier one is still being read
+        int32_t diff = 0;
+        for (uint32_t i = 0; i < n && diff == 0; i++) {
+            diff = (int32_t)(__atomic_load_n(&ring->slots[(pos + i) & ring->mask].sequence, __ATOMIC_ACQUIRE) - (pos + i));
+        }
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + n, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            // Lost the race, pos now holds the new head
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        state_mpsc_slot_t* slot = &ring->slots[(pos + i) & ring->mask];
+        slot->event = events[i];
+#if STATE_LATENCY
+        slot->stamp = stamp;
+#endif
+        __atomic_store_n(&slot->sequence, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+// Consumer side (or a producer dropping the oldest event), returns false if
+// the ring is empty, or the next event has been reserved but not published yet.
+// stamp gets when the event was pushed, 0 without STATE_LATENCY
+static inline bool IRAM_ATTR state_mpsc_pop_stamped(state_mpsc_ring_t* ring, state_event_t* event, uint32_t* stamp) {
+    uint32_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        state_mpsc_slot_t* slot = &ring->slots[pos & ring->mask];
+        int32_t            diff = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                *event = slot->event;
+#if STATE_LATENCY
+                *stamp = slot->stamp;
+#else
+                *stamp = 0;
+#endif
+
+                // Free the slot for the position one lap ahead
+                __atomic_store_n(&slot->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            // Lost the race, pos now holds the new tail
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Same as state_mpsc_pop_stamped(), without the stamp
+static inline bool IRAM_ATTR state_mpsc_pop(state_mpsc_ring_t* ring, state_event_t* event) {
+    uint32_t stamp;
+    return state_mpsc_pop_stamped(ring, event, &stamp);
+}
+
+// Number of reserved events, only a snapshot
+static inline uint32_t IRAM_ATTR state_mpsc_count(state_mpsc_ring_t* ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+}
+
+// Returns true if event is waiting in the ring, only a snapshot
+static inline bool IRAM_ATTR state_mpsc_contains(state_mpsc_ring_t* ring, state_event_t event) {
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    for (uint32_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED); pos != head; pos++) {
+        state_mpsc_slot_t* slot = &ring->slots[pos & ring->mask];
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == pos + 1 && slot->event == event) {
+            return true;
+        }
+    }
+    return false;
+}
@@ -18,6 +18,7 @@
 *                                       STATIC VARIABLES *
 *********************************************************/
 static const char        TAG[] = "TEST_STATE";
+static volatile TickType_t cascade_tick;
 
 /**********************************************************
 *                                         STATE FUNCTIONS *
@@ -51,45 +52,46 @@ static state_t state_b() {
   return NULL_STATE;
 }
 
-// Returns the next state
-static void next_state_func(state_t* curr_state, state_event_t event) {
-    if (!curr_state) {
-        ESP_LOGE(TAG, "ARG==NULL!");
-        ASSERT(0);
-    }
+// Runs on the way from state_a to state_b
+static void log_a_to_b(state_event_t event) {
+    ESP_LOGI(TAG, "Old State: test_state_a, Next: test_state_b");
+}
 
-    if (*curr_state == state_a_enum) {
-        if (event == TEST_EVENT_A) {
-            ESP_LOGI(TAG, "Old State: test_state_a, Next: test_state_b");
-            *curr_state = state_b_enum;
-            return;
-        }
-    }
-    // Stay in the same state
+// Notes when the timer of test_timer_wheel() went off
+static void record_cascade(state_event_t event) {
+    cascade_tick = xTaskGetTickCount();
 }
 
 // These need to sync up to the enum in state_test.h (test_state_e)
 static state_array_s func_translation_table[test_state_len] = {
-   { state_a      ,  portMAX_DELAY                             , cleanup_state_a },
-   { state_b      ,  250/portTICK_PERIOD_MS                    , NULL },
+   { state_a      ,  portMAX_DELAY                             , cleanup_state_a ,  STATE_NO_PARENT ,  NULL },
+   { state_b      ,  250/portTICK_PERIOD_MS                    , NULL            ,  STATE_NO_PARENT ,  NULL },
 };
 
 
-// if this state machine is interested in an event
-// returns true
-static bool event_filter_func(state_event_t event) {
-    if (event == TEST_EVENT_A){
-      return true;
-    }
-    return false;
-}
+// (state, event) -> next state, everything else stays in the same state
+static const state_transition_s transitions[] = {
+   { state_a_enum ,  TEST_EVENT_A ,  state_b_enum ,  log_a_to_b ,  NULL },
+   { state_a_enum ,  TEST_EVENT_TIMER_CASCADE ,  NULL_STATE ,  record_cascade ,  NULL },
+   { state_b_enum ,  TEST_EVENT_TIMER_CASCADE ,  NULL_STATE ,  record_cascade ,  NULL },
+};
+
+// Events this state machine is interested in
+static const state_event_t subscribed_events[] = {
+   TEST_EVENT_A,
+   TEST_EVENT_TIMER_CASCADE,
+};
 
 
 static char* event_print_func(state_event_t event) {
   static char event_a_st[] = "TEST_EVENT_A";
+  static char event_cascade_st[] = "TEST_EVENT_TIMER_CASCADE";
   if(event == TEST_EVENT_A){
     return event_a_st;
   }
+  if(event == TEST_EVENT_TIMER_CASCADE){
+    return event_cascade_st;
+  }
 
   // If no matching event was found, return NULL
   // (probably an error)
@@ -99,13 +101,15 @@ static char* event_print_func(state_event_t event) {
 
 static state_init_s* get_test_state_handle() {
     static state_init_s test_state = {
-        .next_state        = next_state_func,
-        .translation_table = func_translation_table,
-        .event_print       = event_print_func,
-        .starting_state    = state_a_enum,
-        .state_name_string = "test_state",
-        .filter_event      = event_filter_func,
-        .total_states      = test_state_len,
+        .translation_table       = func_translation_table,
+        .event_print             = event_print_func,
+        .starting_state          = state_a_enum,
+        .state_name_string       = "test_state",
+        .subscribed_events       = subscribed_events,
+        .total_subscribed_events = sizeof(subscribed_events) / sizeof(subscribed_events[0]),
+        .total_states            = test_state_len,
+        .transitions             = transitions,
+        .total_transitions       = sizeof(transitions) / sizeof(transitions[0]),
     };
     return &(test_state);
 }
@@ -114,3 +118,34 @@ void test_state_spawner() {
     // State the state machine
     start_new_state_machine(get_test_state_handle());
 }
+
+// A timer parked in level 1 of the wheel has to come down when its lap
+// starts, even if level 0 holds a timer due after it: the service task may
+// not sleep past the cascade
+void test_timer_wheel() {
+    const TickType_t lap = 64; // level 0 of the wheel in state_timer.c
+
+    // Start on a lap, so the first timer lands in level 1
+    while (xTaskGetTickCount() % lap) {
+        vTaskDelay(1);
+    }
+    TickType_t start = xTaskGetTickCount();
+    cascade_tick = 0;
+    state_post_event_at(TEST_EVENT_TIMER_CASCADE, start + lap);
+
+    // Wakes the service task up, so it catches up with the tick
+    state_post_event_at(TEST_EVENT_TIMER_FILLER, start + 40);
+    vTaskDelay(42);
+
+    // A level 0 timer due after the cascade, and one that makes the
+    // service task look at both levels
+    state_post_event_after(TEST_EVENT_TIMER_FILLER, 60);
+    state_post_event_after(TEST_EVENT_TIMER_FILLER, 1);
+
+    vTaskDelay(2 * lap - 42);
+    if (!cascade_tick || cascade_tick - (start + lap) > 2) {
+        ESP_LOGE(TAG, "Timer due at %u fired at %u!", (unsigned)(start + lap), (unsigned)cascade_tick);
+        ASSERT(0);
+    }
+    ESP_LOGI(TAG, "Timer wheel cascade on time");
+}
@@ -6,6 +6,10 @@
  **********************************************************/
 void test_state_spawner();
 
+// Checks that the timer wheel fires on time across levels, must be called
+// after test_state_spawner(). Takes a couple of wheel laps
+void test_timer_wheel();
+
 
 /***********************************************************
  *                                                   ENUMS *
@@ -20,6 +24,8 @@ typedef enum {
 
 typedef enum {
   TEST_EVENT_A = EVENT_START_TEST,
+  TEST_EVENT_TIMER_CASCADE, // recorded by the test machine
+  TEST_EVENT_TIMER_FILLER,  // no subscribers, only there to move the wheel
  
   test_event_len //LEAVE AS LAST!
 } test_event_e;
@@ -0,0 +1,487 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_system.h"
+#include "esp_log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global_defines.h"
+#include "state_core.h"
+
+/**********************************************************
+*                                                 DEFINES *
+**********************************************************/
+// Hierarchical timer wheel: level 0 has one slot per tick, every level
+// above it one slot per lap of the level below. 3 levels of 64 slots reach
+// 262144 ticks ahead, timers further out are parked in the last level
+// and moved closer each time it goes around
+#define WHEEL_BITS   (6)
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS (3)
+#define WHEEL_RANGE  ((TickType_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+#define TIMER_FIRED_MAX (16) // Expiries delivered per pass of the service task
+
+/**********************************************************
+*                                                TYPEDEFS *
+**********************************************************/
+// One armed timer, named by its machine and event, or a delayed
+// event (no machine), known by its state_delayed_t handle
+typedef struct timer_node_s {
+    struct timer_node_s* next;       // in its wheel slot, or the free list
+    struct timer_node_s* prev;
+    struct timer_node_s* hash_next;  // in its name bucket, named timers only
+    state_machine_t      machine;    // NULL for a delayed event, posted to every subscriber
+    state_event_t        event;
+    TickType_t           expiry;
+    TickType_t           period;     // 0 for a one shot timer
+    uint16_t             generation; // bumped when freed, so stale handles don't match
+    uint8_t              level;
+    uint8_t              slot;
+} timer_node_t;
+
+// An expiry, delivered once the wheel is unlocked
+typedef struct {
+    state_machine_t machine;
+    state_event_t   event;
+} timer_fired_t;
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+static const char    TAG[] = "STATE_TIMER";
+static portMUX_TYPE  timer_lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t  timer_task;
+
+// All of the following are protected by timer_lock
+static timer_node_t  timer_nodes[STATE_MAX_TIMERS];
+static timer_node_t* timer_free;
+static timer_node_t* timer_names[STATE_MAX_TIMERS];              // hash of (machine, event)
+static timer_node_t* wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint64_t      wheel_occupied[WHEEL_LEVELS];               // one bit per non empty slot
+static TickType_t    wheel_now;                                  // last tick the wheel has processed
+static TickType_t    wheel_wake;                                 // when the service task wakes up next
+static bool          wheel_idle = true;                          // service task sleeps until notified
+static bool          wheel_started;
+static bool          timer_full_logged;                          // delayed posts only complain once
+static bool          wheel_draining;                             // level 0 slot of wheel_now not done yet
+static volatile bool timer_delivering;                           // service task is posting expiries it took off the wheel
+static int           timers_armed;
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+
+// Must hold timer_lock
+static timer_node_t** name_bucket(state_machine_t machine, state_event_t event) {
+    uint32_t hash = ((uint32_t)(uintptr_t)machine >> 4) ^ (event * 2654435761u);
+    return &timer_names[(hash >> 16) % STATE_MAX_TIMERS];
+}
+
+// Must hold timer_lock
+static timer_node_t* find_timer(state_machine_t machine, state_event_t event) {
+    for (timer_node_t* node = *name_bucket(machine, event); node; node = node->hash_next) {
+        if (node->machine == machine && node->event == event) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+// Puts a timer in the slot of its expiry, must hold timer_lock
+static void wheel_insert(timer_node_t* node) {
+    TickType_t delta  = node->expiry - wheel_now;
+    TickType_t expiry = node->expiry;
+    int        level  = 0;
+
+    // Too far out, park it in the last level until it comes around
+    if (delta >= WHEEL_RANGE) {
+        expiry = wheel_now + WHEEL_RANGE - 1;
+        delta  = WHEEL_RANGE - 1;
+    }
+    while (delta >= ((TickType_t)1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+
+    node->level = level;
+    node->slot  = (expiry >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    node->prev  = NULL;
+    node->next  = wheel[level][node->slot];
+    if (node->next) {
+        node->next->prev = node;
+    }
+    wheel[level][node->slot] = node;
+    wheel_occupied[level] |= (uint64_t)1 << node->slot;
+}
+
+// Must hold timer_lock
+static void wheel_remove(timer_node_t* node) {
+    if (node->prev) {
+        node->prev->next = node->next;
+    } else {
+        wheel[node->level][node->slot] = node->next;
+    }
+    if (node->next) {
+        node->next->prev = node->prev;
+    }
+    if (!wheel[node->level][node->slot]) {
+        wheel_occupied[node->level] &= ~((uint64_t)1 << node->slot);
+    }
+}
+
+// Drops a timer for good, must hold timer_lock
+static void free_timer(timer_node_t* node) {
+    if (node->machine) {
+        timer_node_t** link = name_bucket(node->machine, node->event);
+        while (*link != node) {
+            link = &(*link)->hash_next;
+        }
+        *link = node->hash_next;
+    }
+
+    node->machine = NULL;
+    node->generation++;
+    node->next = timer_free;
+    timer_free = node;
+    timers_armed--;
+}
+
+// Moves the timers of the current slot of a level down to the levels below
+static void wheel_cascade(int level) {
+    int           slot = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    timer_node_t* node = wheel[level][slot];
+
+    wheel[level][slot] = NULL;
+    wheel_occupied[level] &= ~((uint64_t)1 << slot);
+    while (node) {
+        timer_node_t* next = node->next;
+        wheel_insert(node);
+        node = next;
+    }
+}
+
+// Moves the wheel on by one tick, must hold timer_lock
+static void wheel_step() {
+    wheel_now++;
+    wheel_draining = true;
+
+    // Starting a new lap, bring the next slot of the level above down
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if ((wheel_now >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) {
+            break;
+        }
+        wheel_cascade(level);
+    }
+}
+
+// Collects up to TIMER_FIRED_MAX timers that expired at wheel_now,
+// returns how many. Must hold timer_lock
+static int wheel_drain(timer_fired_t* fired) {
+    int total = 0;
+    int slot  = wheel_now & WHEEL_MASK;
+
+    while (wheel[0][slot] && total < TIMER_FIRED_MAX) {
+        timer_node_t* node = wheel[0][slot];
+        wheel_remove(node);
+
+        fired[total].machine = node->machine;
+        fired[total].event   = node->event;
+        total++;
+
+        // Always lands in a later slot, period > 0
+        if (node->period) {
+            node->expiry += node->period;
+            wheel_insert(node);
+        } else {
+            free_timer(node);
+        }
+    }
+
+    wheel_draining = wheel[0][slot] != NULL;
+    return total;
+}
+
+// Ticks from wheel_now until the wheel has to move again,
+// portMAX_DELAY if there are no timers. Must hold timer_lock
+static TickType_t wheel_next() {
+    TickType_t next = portMAX_DELAY;
+
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (wheel_occupied[level]) {
+            // The next cascade may bring timers down ahead of level 0's
+            next = WHEEL_SLOTS - (wheel_now & WHEEL_MASK);
+            break;
+        }
+    }
+
+    if (wheel_occupied[0]) {
+        // Closest occupied slot after the current one
+        int        shift   = (wheel_now + 1) & WHEEL_MASK;
+        uint64_t   rotated = shift ? (wheel_occupied[0] >> shift) | (wheel_occupied[0] << (WHEEL_SLOTS - shift))
+                                   : wheel_occupied[0];
+        TickType_t ticks   = __builtin_ctzll(rotated) + 1;
+        if (ticks < next) {
+            next = ticks;
+        }
+    }
+    return next;
+}
+
+// Turns the wheel, and delivers expiries as events to their machines
+static void timer_service(void* v) {
+    ESP_LOGI(TAG, "Starting timer service");
+    for (;;) {
+        timer_fired_t fired[TIMER_FIRED_MAX];
+        int           total = 0;
+        TickType_t    wait  = 0;
+        TickType_t    now   = xTaskGetTickCount();
+
+        portENTER_CRITICAL(&timer_lock);
+        if (!timers_armed) {
+            // Nothing to turn, just keep up
+            wheel_now      = now;
+            wheel_draining = false;
+        }
+
+        if (wheel_draining) {
+            total = wheel_drain(fired);
+        } else if ((int32_t)(now - wheel_now) > 0) {
+            // Behind, an arm may also have moved an empty wheel past our now
+            wheel_step();
+            total = wheel_drain(fired);
+        } else {
+            wait = wheel_next();
+        }
+        wheel_wake       = now + wait;
+        wheel_idle       = wait == portMAX_DELAY;
+        timer_delivering = total > 0;
+        portEXIT_CRITICAL(&timer_lock);
+
+        // Outside the lock, so the machines can rearm while we deliver
+        for (int i = 0; i < total; i++) {
+            if (fired[i].machine) {
+                state_post_event_to(fired[i].machine, fired[i].event);
+                continue;
+            }
+
+            // Multiplexer ring full, give it a tick to catch up
+            while (!state_try_post_event(fired[i].event)) {
+                vTaskDelay(1);
+            }
+        }
+        timer_delivering = false;
+
+        if (wait) {
+            ulTaskNotifyTake(pdTRUE, wait);
+        }
+    }
+}
+
+// Starts the service task on first use
+static void start_timer_service() {
+    static volatile uint32_t starting;
+
+    if (timer_task || __atomic_exchange_n(&starting, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    BaseType_t rc = xTaskCreate(timer_service,
+                                "state_timer",
+                                STATE_TIMER_STACK_DEPTH,
+                                NULL,
+                                STATE_TIMER_PRIORITY,
+                                &timer_task);
+    if (rc != pdPASS) {
+        ASSERT(0);
+    }
+}
+
+// Sets up the pool and the wheel on first use, and brings an empty wheel
+// up to now. The service task only turns the wheel while timers are armed,
+// it would otherwise step through every tick it slept. Must hold timer_lock
+static void wheel_start(TickType_t now) {
+    if (!wheel_started) {
+        for (int i = STATE_MAX_TIMERS - 1; i >= 0; i--) {
+            timer_nodes[i].next = timer_free;
+            timer_free          = &timer_nodes[i];
+        }
+        wheel_wake    = now;
+        wheel_started = true;
+    }
+
+    if (!timers_armed) {
+        wheel_now      = now;
+        wheel_draining = false;
+    }
+}
+
+// Takes a node from the pool, NULL if it is empty. Must hold timer_lock
+static timer_node_t* alloc_timer() {
+    timer_node_t* node = timer_free;
+    if (!node) {
+        return NULL;
+    }
+    timer_free = node->next;
+    timers_armed++;
+    return node;
+}
+
+// Puts a node on the wheel. Returns true if the service task has to be
+// woken up to catch the new expiry. Must hold timer_lock
+static bool arm_timer(timer_node_t* node, TickType_t expiry) {
+    // The wheel may already be past expiry, never put a timer behind it
+    node->expiry = expiry;
+    if ((int32_t)(node->expiry - wheel_now) <= 0) {
+        node->expiry = wheel_now + 1;
+    }
+    wheel_insert(node);
+
+    // The service task sleeps past the new expiry, move it up
+    return wheel_idle || (int32_t)(node->expiry - wheel_wake) < 0;
+}
+
+static void wake_timer_service(bool wake) {
+    if (wake && timer_task) {
+        xTaskNotifyGive(timer_task);
+    }
+}
+
+void state_timer_start(state_machine_t machine, state_event_t event, TickType_t ticks, bool periodic) {
+    if (!machine || ticks == 0 || ticks == portMAX_DELAY) {
+        ESP_LOGE(TAG, "Invalid timer (event %d, %d ticks)", event, (int)ticks);
+        ASSERT(0);
+    }
+
+    start_timer_service();
+
+    TickType_t now = xTaskGetTickCount();
+    bool       wake;
+
+    portENTER_CRITICAL(&timer_lock);
+    wheel_start(now);
+
+    // Restarting a timer rearms it
+    timer_node_t* node = find_timer(machine, event);
+    if (node) {
+        wheel_remove(node);
+    } else {
+        node = alloc_timer();
+        if (!node) {
+            portEXIT_CRITICAL(&timer_lock);
+            ESP_LOGE(TAG, "Too many timers, increase STATE_MAX_TIMERS!");
+            ASSERT(0);
+        }
+
+        timer_node_t** bucket = name_bucket(machine, event);
+        node->machine   = machine;
+        node->event     = event;
+        node->hash_next = *bucket;
+        *bucket         = node;
+    }
+
+    node->period = periodic ? ticks : 0;
+    wake = arm_timer(node, now + ticks);
+    portEXIT_CRITICAL(&timer_lock);
+
+    wake_timer_service(wake);
+}
+
+state_delayed_t state_post_event_at(state_event_t event, TickType_t tick) {
+    start_timer_service();
+
+    TickType_t now = xTaskGetTickCount();
+
+    portENTER_CRITICAL(&timer_lock);
+    wheel_start(now);
+
+    timer_node_t* node = alloc_timer();
+    if (!node) {
+        bool logged       = timer_full_logged;
+        timer_full_logged = true;
+        portEXIT_CRITICAL(&timer_lock);
+
+        // Dropped like a post to a full multiplexer, the payload goes back
+        state_payload_release(STATE_EVENT_PAYLOAD(event));
+        if (!logged) {
+            ESP_LOGW(TAG, "Timer pool full, dropping delayed events, increase STATE_MAX_TIMERS");
+        }
+        return STATE_DELAYED_NONE;
+    }
+    node->machine = NULL;
+    node->event   = event;
+    node->period  = 0;
+    bool wake = arm_timer(node, tick);
+
+    // Index + 1 in the low half, so a handle is never STATE_DELAYED_NONE
+    state_delayed_t handle = ((state_delayed_t)node->generation << 16) | (node - timer_nodes + 1);
+    portEXIT_CRITICAL(&timer_lock);
+
+    wake_timer_service(wake);
+    return handle;
+}
+
+state_delayed_t state_post_event_after(state_event_t event, TickType_t ticks) {
+    return state_post_event_at(event, xTaskGetTickCount() + ticks);
+}
+
+bool state_cancel_delayed(state_delayed_t handle) {
+    int  index     = (int)(handle & 0xFFFF) - 1;
+    bool cancelled = false;
+
+    if (index < 0 || index >= STATE_MAX_TIMERS) {
+        return false;
+    }
+
+    portENTER_CRITICAL(&timer_lock);
+    timer_node_t* node = &timer_nodes[index];
+
+    // Any node freed since (fired, cancelled) has moved on a generation
+    if (wheel_started && node->generation == (handle >> 16) && !node->machine) {
+        wheel_remove(node);
+        free_timer(node);
+        cancelled = true;
+    }
+    portEXIT_CRITICAL(&timer_lock);
+    return cancelled;
+}
+
+bool state_timer_stop(state_machine_t machine, state_event_t event) {
+    portENTER_CRITICAL(&timer_lock);
+    timer_node_t* node = wheel_started ? find_timer(machine, event) : NULL;
+    if (node) {
+        wheel_remove(node);
+        free_timer(node);
+    }
+    portEXIT_CRITICAL(&timer_lock);
+    return node != NULL;
+}
+
+void state_timer_stop_all(state_machine_t machine) {
+    // A chunk of the pool at a time, so the lock is never held for long
+    for (int i = 0; i < STATE_MAX_TIMERS; i += WHEEL_SLOTS) {
+        portENTER_CRITICAL(&timer_lock);
+        for (int j = i; wheel_started && j < i + WHEEL_SLOTS && j < STATE_MAX_TIMERS; j++) {
+            if (timer_nodes[j].machine == machine) {
+                wheel_remove(&timer_nodes[j]);
+                free_timer(&timer_nodes[j]);
+            }
+        }
+        portEXIT_CRITICAL(&timer_lock);
+    }
+
+    // Expiries taken off the wheel before are posted outside the lock
+    while (timer_delivering && xTaskGetCurrentTaskHandle() != timer_task) {
+        vTaskDelay(1);
+    }
+}
+
+bool state_timer_active(state_machine_t machine, state_event_t event) {
+    portENTER_CRITICAL(&timer_lock);
+    bool active = wheel_started && find_timer(machine, event);
+    portEXIT_CRITICAL(&timer_lock);
+    return active;
+}
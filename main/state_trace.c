@@ -0,0 +1,117 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "global_defines.h"
+#include "state_core.h"
+#include "state_trace.h"
+
+/**********************************************************
+*                                        STATIC VARIABLES *
+**********************************************************/
+#if STATE_TRACE
+// Flight recorder, the last STATE_TRACE_DEPTH records. A writer claims a
+// position, clears the slot's sequence, fills it in and then sets the
+// sequence, so a reader that sees the same sequence before and after
+// copying a slot has a whole record
+static state_trace_record_s trace_ring[STATE_TRACE_DEPTH];
+static uint32_t             trace_head;           // next position to write, atomic
+static volatile bool        trace_enabled = true;
+static const char*          trace_names[STATE_MAX_MACHINES];
+#endif
+
+/**********************************************************
+*                                               FUNCTIONS *
+**********************************************************/
+#if STATE_TRACE
+void IRAM_ATTR state_trace_record(state_trace_e type, int machine, state_t state, state_event_t event) {
+    if (!trace_enabled) {
+        return;
+    }
+
+    uint32_t              pos  = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    state_trace_record_s* slot = &trace_ring[pos & (STATE_TRACE_DEPTH - 1)];
+
+    __atomic_store_n(&slot->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->time_us = (uint32_t)esp_timer_get_time();
+    slot->event   = event;
+    slot->state   = state;
+    slot->machine = machine;
+    slot->type    = type;
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+void state_trace_name(int machine, const char* name) {
+    trace_names[machine] = name;
+}
+
+// Copies the record at a position, returns false if it was overwritten
+// (or is still being written)
+static bool trace_read(uint32_t pos, state_trace_record_s* record) {
+    state_trace_record_s* slot     = &trace_ring[pos & (STATE_TRACE_DEPTH - 1)];
+    uint32_t              sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+
+    *record = *slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return sequence == pos + 1 && __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence;
+}
+#endif
+
+void state_trace_enable(bool enable) {
+#if STATE_TRACE
+    trace_enabled = enable;
+#endif
+}
+
+size_t state_trace_dump(state_trace_record_s* records, size_t max) {
+    size_t total = 0;
+
+#if STATE_TRACE
+    uint32_t head  = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t count = head < STATE_TRACE_DEPTH ? head : STATE_TRACE_DEPTH;
+
+    if (count > max) {
+        count = max;
+    }
+    for (uint32_t pos = head - count; pos != head; pos++) {
+        if (trace_read(pos, &records[total])) {
+            total++;
+        }
+    }
+#endif
+    return total;
+}
+
+void state_trace_print() {
+#if STATE_TRACE
+    uint32_t head  = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t count = head < STATE_TRACE_DEPTH ? head : STATE_TRACE_DEPTH;
+
+    // One line each, for tools/state_trace.py to pick out of a console log
+    printf("STATE_TRACE BEGIN %u\n", (unsigned)count);
+    for (int i = 0; i < STATE_MAX_MACHINES; i++) {
+        if (trace_names[i]) {
+            printf("STATE_TRACE M %d %s\n", i, trace_names[i]);
+        }
+    }
+    for (uint32_t pos = head - count; pos != head; pos++) {
+        state_trace_record_s record;
+        if (trace_read(pos, &record)) {
+            printf("STATE_TRACE R %u %u %u %u %u\n", (unsigned)record.time_us, (unsigned)record.type,
+                   (unsigned)record.machine, (unsigned)record.state, (unsigned)record.event);
+        }
+    }
+    printf("STATE_TRACE END\n");
+#else
+    printf("STATE_TRACE not compiled in, build with STATE_TRACE=1\n");
+#endif
+}
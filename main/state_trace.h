@@ -0,0 +1,28 @@
+#pragma once
+
+#include "state_core.h"
+
+/**********************************************************
+*                   GLOBAL FUNCTIONS
+**********************************************************/
+
+#if STATE_TRACE
+// Appends a record to the trace ring, overwriting the oldest. Safe from
+// any task or ISR, never blocks. Use STATE_TRACE_RECORD, so it compiles
+// out without STATE_TRACE
+void state_trace_record(state_trace_e type, int machine, state_t state, state_event_t event);
+
+// Names a machine ID in state_trace_print() output
+void state_trace_name(int machine, const char* name);
+#endif
+
+/**********************************************************
+*                      DEFINES
+**********************************************************/
+#if STATE_TRACE
+#define STATE_TRACE_RECORD(type, machine, state, event) state_trace_record((type), (machine), (state), (event))
+#define STATE_TRACE_NAME(machine, name)                 state_trace_name((machine), (name))
+#else
+#define STATE_TRACE_RECORD(type, machine, state, event) do { } while (0)
+#define STATE_TRACE_NAME(machine, name)                 do { } while (0)
+#endif
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""Turns a state_trace_print() dump into Chrome trace JSON.
+
+Capture the console (idf.py monitor | tee console.log), call
+state_trace_print() on the device, then
+
+    tools/state_trace.py console.log -o trace.json
+
+and open trace.json in chrome://tracing or https://ui.perfetto.dev. Every
+machine gets a track with its handled events and the state and cleanup
+functions run for them, plus an inbox depth counter. Multiplexer shards get
+a track each with their batches, posts and multiplexer drops share one.
+Only the last dump in the log is used.
+"""
+
+import argparse
+import json
+import re
+import sys
+
+# state_trace_e, keep in sync with state_core.h
+POST, ROUTE_BEGIN, ROUTE_END, ENQUEUE, DROP, HANDLE_BEGIN, HANDLE_END, \
+    STATE_BEGIN, STATE_END, CLEANUP_BEGIN, CLEANUP_END, FORCED = range(12)
+
+NO_MACHINE = 0xFF
+
+# state_event_t layout, see state_core.h
+EVENT_ID_MASK = 0x003FFFFF
+EVENT_PRIO_SHIFT = 22
+EVENT_PAYLOAD_SHIFT = 24
+
+PID = 1
+MUX_TID = 1000    # + shard
+POSTS_TID = 2000
+
+LINE = re.compile(r"STATE_TRACE (BEGIN|M|R|END)\b ?(.*)")
+
+
+def read_dump(lines):
+    """Returns ({machine: name}, [(time_us, type, machine, state, event)])
+    of the last complete dump"""
+    dump = None
+    names, records = {}, []
+    for line in lines:
+        match = LINE.search(line)
+        if not match:
+            continue
+        kind, rest = match.groups()
+        if kind == "BEGIN":
+            names, records = {}, []
+        elif kind == "M":
+            machine, _, name = rest.partition(" ")
+            names[int(machine)] = name.strip()
+        elif kind == "R":
+            records.append(tuple(int(field) for field in rest.split()))
+        else:
+            dump = (names, records)
+    if dump is None:
+        sys.exit("no STATE_TRACE BEGIN ... END dump found")
+    return dump
+
+
+def unwrap(records):
+    """Yields records with their 32 bit us stamps made monotonic from 0"""
+    base = None
+    last = 0
+    now = 0
+    for time_us, *rest in records:
+        if base is None:
+            base = last = time_us
+        # Stamps are taken after a slot is claimed, so they may step back
+        # a little, anything else is a wrap
+        delta = (time_us - last) & 0xFFFFFFFF
+        if delta >= 0x80000000:
+            delta -= 0x100000000
+        now += delta
+        last = time_us
+        yield (max(now, 0), *rest)
+
+
+def event_args(event):
+    return {
+        "event": event & EVENT_ID_MASK,
+        "prio": (event >> EVENT_PRIO_SHIFT) & 3,
+        "payload": event >> EVENT_PAYLOAD_SHIFT,
+    }
+
+
+def convert(names, records):
+    out = []
+    tracks = {}
+    open_spans = {}  # (tid, kind) -> [(start, name, args)]
+    depth = {}       # machine -> events in its inbox
+
+    def track(tid, name):
+        if tid not in tracks:
+            tracks[tid] = name
+            out.append({"ph": "M", "pid": PID, "tid": tid, "name": "thread_name", "args": {"name": name}})
+            out.append({"ph": "M", "pid": PID, "tid": tid, "name": "thread_sort_index", "args": {"sort_index": tid}})
+        return tid
+
+    def machine_track(machine):
+        return track(machine, names.get(machine, "machine %d" % machine))
+
+    def begin(tid, kind, ts, name, args):
+        open_spans.setdefault((tid, kind), []).append((ts, name, args))
+
+    def end(tid, kind, ts, args=None):
+        stack = open_spans.get((tid, kind))
+        if not stack:
+            return  # began before the oldest record
+        start, name, begin_args = stack.pop()
+        out.append({"ph": "X", "pid": PID, "tid": tid, "ts": start, "dur": ts - start,
+                    "name": name, "args": dict(begin_args, **(args or {}))})
+
+    def instant(tid, ts, name, args):
+        out.append({"ph": "i", "s": "t", "pid": PID, "tid": tid, "ts": ts, "name": name, "args": args})
+
+    def inbox(machine, ts, change):
+        depth[machine] = max(depth.get(machine, 0) + change, 0)
+        out.append({"ph": "C", "pid": PID, "ts": ts, "name": "inbox %s" % names.get(machine, machine),
+                    "args": {"events": depth[machine]}})
+
+    out.append({"ph": "M", "pid": PID, "name": "process_name", "args": {"name": "state_core"}})
+    for ts, kind, machine, state, event in unwrap(records):
+        if kind == POST:
+            args = event_args(event)
+            if machine != NO_MACHINE:
+                args["to"] = names.get(machine, machine)
+            instant(track(POSTS_TID, "posts"), ts, "post %d" % (event & EVENT_ID_MASK), args)
+        elif kind in (ROUTE_BEGIN, ROUTE_END):
+            tid = track(MUX_TID + state, "mux %d" % state)
+            if kind == ROUTE_BEGIN:
+                begin(tid, kind, ts, "route", {"first": event & EVENT_ID_MASK})
+            else:
+                end(tid, ROUTE_BEGIN, ts, {"events": event})
+        elif machine == NO_MACHINE:
+            # Dropped by a full multiplexer ring
+            args = dict(event_args(event), lane=state)
+            instant(track(POSTS_TID, "posts"), ts, "drop %d" % (event & EVENT_ID_MASK), args)
+        elif kind == ENQUEUE:
+            machine_track(machine)
+            inbox(machine, ts, +1)
+        elif kind == DROP:
+            # Follows the enqueue of the event that didn't fit
+            args = dict(event_args(event), lane=state)
+            instant(machine_track(machine), ts, "drop %d" % (event & EVENT_ID_MASK), args)
+            inbox(machine, ts, -1)
+        elif kind == HANDLE_BEGIN:
+            tid = machine_track(machine)
+            inbox(machine, ts, -1)
+            begin(tid, kind, ts, "event %d" % (event & EVENT_ID_MASK), dict(event_args(event), state=state))
+        elif kind == HANDLE_END:
+            end(machine_track(machine), HANDLE_BEGIN, ts, {"next": state})
+        elif kind in (STATE_BEGIN, CLEANUP_BEGIN):
+            label = "state %d" if kind == STATE_BEGIN else "cleanup %d"
+            begin(machine_track(machine), kind, ts, label % state, {"state": state})
+        elif kind in (STATE_END, CLEANUP_END):
+            end(machine_track(machine), kind - 1, ts)
+        elif kind == FORCED:
+            instant(machine_track(machine), ts, "forced %d" % state, {"state": state})
+    return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("log", nargs="?", help="console log, stdin if omitted")
+    parser.add_argument("-o", "--output", help="trace JSON, stdout if omitted")
+    args = parser.parse_args()
+
+    source = open(args.log, errors="replace") if args.log else sys.stdin
+    with source:
+        names, records = read_dump(source)
+
+    trace = convert(names, records)
+    if args.output:
+        with open(args.output, "w") as output:
+            json.dump(trace, output)
+    else:
+        json.dump(trace, sys.stdout)
+    print("%d records, %d machines" % (len(records), len(names)), file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()